@@ -24,39 +24,35 @@ list_dir (const char *dir, bool verbose)
 
   if (isdir (dir_fd))
     {
-      char name[READDIR_MAX_LEN];
+      struct dirent ents[32];
+      int cnt, i;
 
       printf ("%s", dir);
       if (verbose)
         printf (" (inumber %d)", inumber (dir_fd));
       printf (":\n");
 
-      while (readdir (dir_fd, name)) 
-        {
-          printf ("%s", name); 
-          if (verbose) 
-            {
-              char full_name[128];
-              int entry_fd;
-
-              snprintf (full_name, sizeof full_name, "%s/%s", dir, name);
-              entry_fd = open (full_name);
-
-              printf (": ");
-              if (entry_fd != -1)
-                {
-                  if (isdir (entry_fd))
-                    printf ("directory");
-                  else
-                    printf ("%d-byte file", filesize (entry_fd));
-                  printf (", inumber %d", inumber (entry_fd));
-                }
-              else
-                printf ("open failed");
-              close (entry_fd);
-            }
-          printf ("\n");
-        }
+      while ((cnt = getdents (dir_fd, ents, sizeof ents / sizeof *ents,
+                              verbose)) > 0)
+        for (i = 0; i < cnt; i++)
+          {
+            printf ("%s", ents[i].name);
+            if (verbose)
+              {
+                printf (": ");
+                if (ents[i].open_failed)
+                  printf ("open failed");
+                else
+                  {
+                    if (ents[i].is_dir)
+                      printf ("directory");
+                    else
+                      printf ("%d-byte file", ents[i].size);
+                    printf (", inumber %d", ents[i].inumber);
+                  }
+              }
+            printf ("\n");
+          }
     }
   else 
     printf ("%s: not a directory\n", dir);
@@ -1,119 +1,890 @@
+#include <string.h>
 #include "threads/thread.h"
 #include "threads/malloc.h"
 #include "filesys/filesys.h"
 #include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
 #include "devices/timer.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include <stdio.h>
 
 
+/* Locking.
+
+   cache_lock protects the replacement lists, cache_map, dirty_list,
+   free_list, chunk_list, entry_count, stats and every cached
+   block's `open' count and flags.  It is never held across disk
+   I/O.
+
+   Each cached block has its own lock which protects its data.  A
+   thread must pin a block (open++) under cache_lock before
+   acquiring the block's lock, and must release the block's lock
+   before unpinning it.  An unpinned block is therefore not locked
+   by anyone, and may be inspected or recycled under cache_lock
+   alone.
+
+   A block is marked dirty when it is released after being
+   modified, and marked clean just before it is written back.  A
+   write that lands during a write-back therefore leaves the block
+   dirty again, to be written on the next pass. */
+
+/* Sizing.
+
+   Block data lives in whole kernel pages, BLOCKS_PER_CHUNK sectors
+   to a page, and the cache grows and shrinks a page (a "chunk") at
+   a time.  It grows on demand while it is below cache_size_limit
+   and the kernel pool has pages to spare.  write_behind_thread()
+   gives back chunks whose blocks are all clean and unused when the
+   kernel pool runs low, down to MIN_CACHE_SIZE. */
+
+/* Replacement.
+
+   Two policies are available, chosen with "-cache-policy" at boot.
+
+   CACHE_CLOCK keeps every block on cache_list and sweeps it with a
+   one-bit clock, skipping metadata blocks on the first sweep.
+
+   CACHE_2Q is the "full" 2Q of Johnson and Shasha.  A block read
+   in for the first time goes on a1_list, a FIFO, and stays there
+   however often it is used; a sector evicted from a1_list is
+   remembered in the ghost list.  A block whose sector is a ghost
+   when it is read again, or which holds metadata, goes on am_list
+   instead, which is kept in LRU order.  Victims are taken from
+   a1_list while it holds more than a quarter of the cache, so a
+   long sequential scan only ever recycles its own blocks. */
+
+/* A page of sector data and the blocks that cache it. */
+struct cache_chunk
+  {
+    struct list_elem elem;		/* Element in chunk_list. */
+    uint8_t *page;			/* Data of every block below. */
+    struct cached_block blocks[BLOCKS_PER_CHUNK];
+  };
+
 struct list cache_list;
 struct lock cache_lock;
-int entry_count;
+
+enum cache_policy cache_policy = CACHE_2Q;
+
+/* 2Q queues, oldest first, and the number of blocks on a1_list. */
+static struct list a1_list;
+static struct list am_list;
+static int a1_count;
+
+/* A sector recently evicted from a1_list. */
+struct cache_ghost
+  {
+    block_sector_t sector;
+    struct list_elem elem;		/* Element in ghost_list. */
+    struct hash_elem hash_elem;		/* Element in ghost_map. */
+  };
+
+/* Ghosts, oldest first and indexed by sector.  At most half as
+   many as there are blocks in the cache. */
+static struct list ghost_list;
+static struct hash ghost_map;
+static int ghost_count;
+int entry_count;			/* Blocks in all chunks. */
+
+int cache_size_limit;
+
+/* Every chunk of the cache. */
+static struct list chunk_list;
+
+/* Blocks that hold no sector yet.  They are in neither cache_list
+   nor cache_map. */
+static struct list free_list;
+
+/* Counters reported by cache_print_stats(). */
+static struct cache_stats stats;
+
+/* Index of the cached blocks in cache_list, keyed by sector, so
+   that lookup_cache() does not have to walk the clock list. */
+static struct hash cache_map;
+
+/* Signaled when a cached block becomes unpinned. */
+static struct condition cache_unpinned;
+
+/* Dirty blocks, in no particular order. */
+static struct list dirty_list;
+
+/* Serializes cache_write_behind(), which owns every block's
+   flush_elem while it runs. */
+static struct lock flush_lock;
 
 static struct list_elem *e = NULL;
 
+/* Bounce buffers for multi-sector transfers of runs of adjacent
+   blocks.  flush_buffer belongs to the holder of flush_lock,
+   read_ahead_buffer to read_ahead_thread(). */
+#define CACHE_RUN_PAGES \
+        DIV_ROUND_UP (CACHE_RUN_SECTORS * BLOCK_SECTOR_SIZE, PGSIZE)
+static uint8_t *flush_buffer;
+static uint8_t *read_ahead_buffer;
+
+int read_ahead_window = READ_AHEAD_WINDOW;
+
+/* Ring buffer of sectors waiting to be read ahead by
+   read_ahead_thread(), protected by read_ahead_lock.  Requests that
+   do not fit are dropped. */
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static int read_ahead_head;
+static int read_ahead_count;
+static struct lock read_ahead_lock;
+static struct condition read_ahead_cond;
+
+static struct cached_block *alloc_cache_block (bool);
+static struct cached_block *pin_cached_block (block_sector_t);
+static void insert_cache_block (struct cached_block *, bool);
+static void remove_cache_block (struct cached_block *);
+static void touch_cache_block (struct cached_block *);
+static struct cached_block *evict_clock (void);
+static struct cached_block *evict_2q (void);
+static struct cached_block *scan_victim (struct list *);
+static void add_ghost (block_sector_t);
+static bool take_ghost (block_sector_t);
+static unsigned ghost_hash_func (const struct hash_elem *, void *);
+static bool ghost_less_func (const struct hash_elem *,
+                             const struct hash_elem *, void *);
+static bool grow_cache (void);
+static void shrink_cache (void);
+static bool shrink_cache_chunk (struct cache_chunk *);
+static void claim_cache_block (struct cached_block *, block_sector_t, bool);
+static void load_cache_run (block_sector_t, block_sector_t);
+static void write_back_cache_run (struct cached_block **, int);
+static void write_back_cache_block (struct cached_block *);
+static void unpin_cache_block (struct cached_block *);
+static void mark_dirty (struct cached_block *);
+static void mark_clean (struct cached_block *);
+static bool cache_sector_less (const struct list_elem *,
+                               const struct list_elem *, void *);
+
 void
 cache_init (void)
 {
   list_init (&cache_list);
+  list_init (&a1_list);
+  list_init (&am_list);
+  a1_count = 0;
+  list_init (&ghost_list);
+  hash_init (&ghost_map, ghost_hash_func, ghost_less_func, NULL);
+  ghost_count = 0;
+  hash_init (&cache_map, cache_hash_func, cache_less_func, NULL);
   lock_init (&cache_lock);
+  cond_init (&cache_unpinned);
+  list_init (&dirty_list);
+  lock_init (&flush_lock);
+  list_init (&chunk_list);
+  list_init (&free_list);
   entry_count = 0;
-  //thread_create ("write_behind_thread", PRI_MIN, write_behind_thread, NULL);
+  if (cache_size_limit <= 0)
+    cache_size_limit = palloc_free_count (0) / 4 * BLOCKS_PER_CHUNK;
+  if (cache_size_limit < MIN_CACHE_SIZE)
+    cache_size_limit = MIN_CACHE_SIZE;
+  flush_buffer = palloc_get_multiple (PAL_ASSERT, CACHE_RUN_PAGES);
+  thread_create ("write_behind_thread", PRI_MIN, write_behind_thread, NULL);
+
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_cond);
+  read_ahead_head = 0;
+  read_ahead_count = 0;
+  if (read_ahead_window > 0)
+  {
+    read_ahead_buffer = palloc_get_multiple (PAL_ASSERT, CACHE_RUN_PAGES);
+    thread_create ("read_ahead_thread", PRI_DEFAULT, read_ahead_thread, NULL);
+  }
 }
 
 
+/* Returns the cached block for SECTOR, reading it from disk if it
+   is not cached yet.  The block is returned pinned and with its
+   lock held; the caller must give it back with
+   release_cached_block().  METADATA says whether SECTOR holds file
+   system metadata, which the replacement policy tries to keep.
+
+   A miss is serviced with only the new block's lock held, so other
+   threads may use the rest of the cache meanwhile.  Threads asking
+   for the same sector find the block in cache_map while it is
+   still loading and wait on its lock instead of reading the sector
+   a second time. */
 struct cached_block *
-get_cached_block (block_sector_t sector, bool dirty)
+get_cached_block (block_sector_t sector, bool metadata)
 {
-  lock_acquire (&cache_lock);
-
-  struct cached_block *cb = lookup_cache (sector);
+  struct cached_block *cb;
 
-  if (cb == NULL)
+  lock_acquire (&cache_lock);
+  while (true)
   {
-    if (entry_count < MAX_CACHE_SIZE)
+    cb = lookup_cache (sector);
+    if (cb != NULL)
     {
-      cb = (struct cached_block *) malloc (sizeof (struct cached_block));
-      if (cb == NULL)
+      stats.hits++;
+      if (cb->read_ahead)
       {
-        lock_release (&cache_lock);
-        PANIC ("ERROR : Main and Cache memory full.");
+        stats.read_ahead_hits++;
+        cb->read_ahead = false;
       }
-      cb->open = 0;
-      entry_count++;
+      touch_cache_block (cb);
+      cb->accessed = true;
+      cb->open++;
+      lock_release (&cache_lock);
+      lock_acquire (&cb->lock);
+      ASSERT (!cb->loading);
+      break;
     }
-    else
+
+    cb = alloc_cache_block (true);
+    if (cb != NULL)
     {
-      cb = evict_cache_block ();
-      list_remove (&cb->elem);
+      stats.misses++;
+      claim_cache_block (cb, sector, metadata);
+      cb->accessed = true;
+      lock_release (&cache_lock);
+
+      block_read (fs_device, sector, cb->data);
+      cb->loading = false;
+      break;
     }
-    cb->sector = sector;
-    block_read (fs_device, sector, cb->data);
-    cb->accessed = true;
-    cb->open++;
-    cb->dirty = dirty;
-    list_push_back (&cache_list, &cb->elem);
+    /* alloc_cache_block() had to drop cache_lock, so SECTOR may
+       have been brought in by someone else meanwhile.  Look again. */
   }
-  else
+
+  return cb;
+}
+
+/* Releases the lock on CB and unpins it.  DIRTY says whether the
+   caller modified CB's data. */
+void
+release_cached_block (struct cached_block *cb, bool dirty)
+{
+  lock_release (&cb->lock);
+  lock_acquire (&cache_lock);
+  if (dirty)
+    mark_dirty (cb);
+  unpin_cache_block (cb);
+  lock_release (&cache_lock);
+}
+
+/* Copies SIZE bytes starting at byte SECTOR_OFS of SECTOR into
+   BUFFER, going through the cache.  METADATA is as for
+   get_cached_block(). */
+void
+cache_read (block_sector_t sector, void *buffer, int sector_ofs, int size,
+            bool metadata)
+{
+  struct cached_block *cb = get_cached_block (sector, metadata);
+
+  memcpy (buffer, cb->data + sector_ofs, size);
+  release_cached_block (cb, false);
+}
+
+/* Copies SIZE bytes from BUFFER into SECTOR starting at byte
+   SECTOR_OFS, going through the cache.  METADATA is as for
+   get_cached_block(). */
+void
+cache_write (block_sector_t sector, const void *buffer, int sector_ofs,
+             int size, bool metadata)
+{
+  struct cached_block *cb = get_cached_block (sector, metadata);
+
+  memcpy (cb->data + sector_ofs, buffer, size);
+  release_cached_block (cb, true);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR into
+   BUFFER with one multi-sector request, without bringing them into
+   the cache.  Sectors that are cached anyway are copied from the
+   cache, which may be newer than the disk. */
+void
+cache_read_direct (block_sector_t sector, block_sector_t cnt, void *buffer)
+{
+  uint8_t *p = buffer;
+  block_sector_t i;
+
+  block_read_multiple (fs_device, sector, cnt, buffer);
+  for (i = 0; i < cnt; i++)
   {
-    cb->accessed = true;
-    cb->open++;
-    cb->dirty |= dirty;
+    struct cached_block *cb = pin_cached_block (sector + i);
+    if (cb != NULL)
+    {
+      memcpy (p + i * BLOCK_SECTOR_SIZE, cb->data, BLOCK_SECTOR_SIZE);
+      release_cached_block (cb, false);
+    }
   }
-  lock_release (&cache_lock);
-  return cb;
 }
 
+/* Writes the CNT consecutive sectors starting at SECTOR from
+   BUFFER with one multi-sector request, without bringing them into
+   the cache.
 
+   Sectors that are cached anyway get the new data too, and are
+   marked dirty: a write-back of the old data that races with ours
+   could otherwise leave the disk stale behind a clean cached copy.
+   Looking them up only after the disk write means that a block
+   loaded from the old data meanwhile is in cache_map by now, so it
+   is found and overwritten as well. */
+void
+cache_write_direct (block_sector_t sector, block_sector_t cnt,
+                    const void *buffer)
+{
+  const uint8_t *p = buffer;
+  block_sector_t i;
 
+  block_write_multiple (fs_device, sector, cnt, buffer);
+  for (i = 0; i < cnt; i++)
+  {
+    struct cached_block *cb = pin_cached_block (sector + i);
+    if (cb != NULL)
+    {
+      memcpy (cb->data, p + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+      release_cached_block (cb, true);
+    }
+  }
+}
+
+/* Returns the cached block for SECTOR pinned and locked, as
+   get_cached_block() does, if SECTOR is cached.  Otherwise returns
+   a null pointer without reading it.  Counts the access as a
+   direct one rather than a hit. */
+static struct cached_block *
+pin_cached_block (block_sector_t sector)
+{
+  struct cached_block *cb;
+
+  lock_acquire (&cache_lock);
+  stats.direct++;
+  cb = lookup_cache (sector);
+  if (cb != NULL)
+    cb->open++;
+  lock_release (&cache_lock);
+
+  if (cb != NULL)
+    lock_acquire (&cb->lock);
+  return cb;
+}
+
+/* Returns the cached block holding SECTOR, or a null pointer if
+   SECTOR is not in the cache.  Must be called with cache_lock held. */
 struct cached_block *
 lookup_cache (block_sector_t sector)
+{
+  struct cached_block cb;
+  struct hash_elem *e;
+
+  cb.sector = sector;
+  e = hash_find (&cache_map, &cb.hash_elem);
+  if (e == NULL)
+    return NULL;
+  return hash_entry (e, struct cached_block, hash_elem);
+}
+
+/* Returns a clean, unpinned block that is no longer in cache_map,
+   ready to be claimed for a new sector, or a null pointer if
+   cache_lock had to be released before one could be found.  If
+   every block is pinned, waits for one to be released and returns
+   a null pointer if WAIT is true, or returns a null pointer at
+   once if WAIT is false.  Must be called with cache_lock held. */
+static struct cached_block *
+alloc_cache_block (bool wait)
 {
   struct cached_block *cb;
-  struct list_elem *e;
 
-  for (e = list_begin(&cache_list); e != list_end(&cache_list);
-       e = list_next(e))
+  if (list_empty (&free_list))
+    grow_cache ();
+  if (!list_empty (&free_list))
+  {
+    cb = list_entry (list_pop_front (&free_list), struct cached_block, elem);
+    cb->free = false;
+    return cb;
+  }
+
+  cb = evict_cache_block ();
+  if (cb == NULL)
+  {
+    /* Every block is pinned.  Wait for one to be released. */
+    if (wait)
+      cond_wait (&cache_unpinned, &cache_lock);
+    return NULL;
+  }
+
+  if (cb->dirty)
+  {
+    /* Write the victim back without cache_lock held.  It may be
+       looked up again while we write, so let the caller start
+       over instead of assuming it is still free afterwards. */
+    stats.dirty_evictions++;
+    mark_clean (cb);
+    cb->open++;
+    lock_release (&cache_lock);
+    write_back_cache_block (cb);
+    lock_acquire (&cache_lock);
+    unpin_cache_block (cb);
+    return NULL;
+  }
+
+  stats.clean_evictions++;
+  if (cb->read_ahead)
+    stats.read_ahead_wasted++;
+  if (cache_policy == CACHE_2Q && !cb->hot)
+    add_ghost (cb->sector);
+  remove_cache_block (cb);
+  hash_delete (&cache_map, &cb->hash_elem);
+  return cb;
+}
+
+/* Adds a chunk of free blocks to free_list, if the cache is below
+   cache_size_limit and the kernel pool can spare a page.  Returns
+   true if successful.  Must be called with cache_lock held. */
+static bool
+grow_cache (void)
+{
+  struct cache_chunk *chunk;
+  bool needed = entry_count < MIN_CACHE_SIZE;
+  int i;
+
+  if (entry_count + BLOCKS_PER_CHUNK > cache_size_limit)
+    return false;
+  if (!needed && palloc_free_count (0) <= 2 * CACHE_LOW_PAGES)
+    return false;
+
+  chunk = malloc (sizeof *chunk);
+  if (chunk != NULL)
+  {
+    chunk->page = palloc_get_page (0);
+    if (chunk->page == NULL)
+    {
+      free (chunk);
+      chunk = NULL;
+    }
+  }
+  if (chunk == NULL)
+  {
+    if (needed)
+      PANIC ("ERROR : Main and Cache memory full.");
+    return false;
+  }
+
+  for (i = 0; i < BLOCKS_PER_CHUNK; i++)
+  {
+    struct cached_block *cb = &chunk->blocks[i];
+
+    cb->data = chunk->page + i * BLOCK_SECTOR_SIZE;
+    lock_init (&cb->lock);
+    cb->accessed = false;
+    cb->dirty = false;
+    cb->loading = false;
+    cb->free = true;
+    cb->read_ahead = false;
+    cb->open = 0;
+    list_push_back (&free_list, &cb->elem);
+  }
+  list_push_back (&chunk_list, &chunk->elem);
+  entry_count += BLOCKS_PER_CHUNK;
+  return true;
+}
+
+/* Gives chunks back to the kernel pool while it is short of pages
+   or the cache is over cache_size_limit.  Only chunks whose blocks
+   are all clean and unpinned can go; the rest stay until a later
+   call.  Must be called with cache_lock held. */
+static void
+shrink_cache (void)
+{
+  struct list_elem *ce = list_begin (&chunk_list);
+  size_t free_pages = palloc_free_count (0);
+
+  while (ce != list_end (&chunk_list)
+         && entry_count - BLOCKS_PER_CHUNK >= MIN_CACHE_SIZE
+         && (entry_count > cache_size_limit
+             || free_pages < CACHE_LOW_PAGES))
+  {
+    struct cache_chunk *chunk = list_entry (ce, struct cache_chunk, elem);
+
+    ce = list_next (ce);
+    if (shrink_cache_chunk (chunk))
+      free_pages++;
+  }
+}
+
+/* Removes CHUNK from the cache and frees it, if none of its blocks
+   is pinned or dirty.  Returns true if successful.  Must be called
+   with cache_lock held. */
+static bool
+shrink_cache_chunk (struct cache_chunk *chunk)
+{
+  int i;
+
+  for (i = 0; i < BLOCKS_PER_CHUNK; i++)
+    if (chunk->blocks[i].open > 0 || chunk->blocks[i].dirty)
+      return false;
+
+  for (i = 0; i < BLOCKS_PER_CHUNK; i++)
+  {
+    struct cached_block *cb = &chunk->blocks[i];
+
+    if (!cb->free)
+    {
+      if (cb->read_ahead)
+        stats.read_ahead_wasted++;
+      remove_cache_block (cb);
+      hash_delete (&cache_map, &cb->hash_elem);
+    }
+    else
+      list_remove (&cb->elem);
+  }
+  list_remove (&chunk->elem);
+  entry_count -= BLOCKS_PER_CHUNK;
+  palloc_free_page (chunk->page);
+  free (chunk);
+  return true;
+}
+
+/* Publishes free block CB in cache_map as the copy of SECTOR, in
+   its loading state: pinned, and with its lock held until the
+   caller has filled in its data.  METADATA is as for
+   get_cached_block().  Must be called with cache_lock held. */
+static void
+claim_cache_block (struct cached_block *cb, block_sector_t sector,
+                   bool metadata)
+{
+  ASSERT (cb->open == 0);
+
+  cb->sector = sector;
+  cb->loading = true;
+  cb->read_ahead = false;
+  cb->open++;
+  hash_insert (&cache_map, &cb->hash_elem);
+  insert_cache_block (cb, metadata);
+
+  /* CB is unpinned, so nobody holds its lock and this does not
+     block. */
+  lock_acquire (&cb->lock);
+}
+
+/* Brings the CNT sectors starting at SECTOR into the cache,
+   reading each run of them that is not cached yet with a single
+   multi-sector request.  Gives up on the rest of the range instead
+   of waiting if the cache runs out of unpinned blocks. */
+static void
+load_cache_run (block_sector_t sector, block_sector_t cnt)
+{
+  struct cached_block *run[CACHE_RUN_SECTORS];
+
+  ASSERT (cnt <= CACHE_RUN_SECTORS);
+
+  while (cnt > 0)
+  {
+    block_sector_t n = 0;
+    block_sector_t i;
+
+    lock_acquire (&cache_lock);
+    while (cnt > 0 && lookup_cache (sector) != NULL)
+    {
+      sector++;
+      cnt--;
+    }
+    while (n < cnt && lookup_cache (sector + n) == NULL)
+    {
+      struct cached_block *cb = alloc_cache_block (false);
+      if (cb == NULL)
+        break;
+      claim_cache_block (cb, sector + n, false);
+      cb->read_ahead = true;
+      stats.read_aheads++;
+      run[n++] = cb;
+    }
+    lock_release (&cache_lock);
+    if (n == 0)
+      return;
+
+    block_read_multiple (fs_device, sector, n, read_ahead_buffer);
+    for (i = 0; i < n; i++)
+    {
+      memcpy (run[i]->data, read_ahead_buffer + i * BLOCK_SECTOR_SIZE,
+              BLOCK_SECTOR_SIZE);
+      run[i]->loading = false;
+      release_cached_block (run[i], false);
+    }
+    sector += n;
+    cnt -= n;
+  }
+}
+
+/* Adds CB, which is in no replacement list, to the one the policy
+   picks for a newly read block.  Must be called with cache_lock
+   held. */
+static void
+insert_cache_block (struct cached_block *cb, bool metadata)
+{
+  cb->metadata = metadata;
+  cb->accessed = false;
+  if (cache_policy == CACHE_CLOCK)
+  {
+    /* Just behind the hand, i.e. where an evicted block was. */
+    if (e != NULL)
+      list_insert (e, &cb->elem);
+    else
+      list_push_back (&cache_list, &cb->elem);
+  }
+  else
+  {
+    cb->hot = take_ghost (cb->sector) || metadata;
+    if (cb->hot)
+      list_push_back (&am_list, &cb->elem);
+    else
     {
-      cb = list_entry(e, struct cached_block, elem);
-      if (cb->sector == sector)
-	{
-	  return cb;
-	}
+      list_push_back (&a1_list, &cb->elem);
+      a1_count++;
     }
-  return NULL;
+  }
+}
+
+/* Takes CB off its replacement list.  Must be called with
+   cache_lock held. */
+static void
+remove_cache_block (struct cached_block *cb)
+{
+  if (cache_policy == CACHE_CLOCK)
+  {
+    if (e == &cb->elem)
+    {
+      e = list_next (e);
+      if (e == list_end (&cache_list))
+        e = NULL;
+    }
+  }
+  else if (!cb->hot)
+    a1_count--;
+  list_remove (&cb->elem);
+}
+
+/* Records a use of CB, which is already cached.  Must be called
+   with cache_lock held. */
+static void
+touch_cache_block (struct cached_block *cb)
+{
+  if (cache_policy == CACHE_2Q && cb->hot)
+  {
+    list_remove (&cb->elem);
+    list_push_back (&am_list, &cb->elem);
+  }
 }
 
+/* Returns an unpinned block to evict, preferring clean ones, or a
+   null pointer if every block is pinned.  The victim is still in
+   cache_map and in its replacement list.  Must be called with
+   cache_lock held. */
 struct cached_block *
 evict_cache_block (void)
 {
+  if (cache_policy == CACHE_CLOCK)
+    return evict_clock ();
+  else
+    return evict_2q ();
+}
 
+/* Picks a victim by sweeping the clock hand over cache_list. */
+static struct cached_block *
+evict_clock (void)
+{
   struct cached_block *cb;
+  struct cached_block *dirty_victim = NULL;
+  int scanned;
 
+  if (list_empty (&cache_list))
+    return NULL;
   if (e == NULL)
     e = list_begin (&cache_list);
-  
-  while (true)
+
+  /* Two full sweeps are enough to clear every accessed bit.
+     Metadata blocks are only given up on the second. */
+  for (scanned = 0; scanned < 2 * entry_count; scanned++)
   {
     cb = list_entry (e, struct cached_block, elem);
 
+    e = list_next (e);
+    if (e == list_end (&cache_list))
+      e = list_begin (&cache_list);
+
     if (cb->open > 0)
       continue;
     else if (cb->accessed)
       cb->accessed = false;
-    else
-    {
-      if (cb->dirty)
-        block_write (fs_device, cb->sector, cb->data);
-      break;
-    }
+    else if (cb->metadata && scanned < entry_count)
+      continue;
+    else if (!cb->dirty)
+      return cb;
+    else if (dirty_victim == NULL)
+      dirty_victim = cb;
+  }
 
-    e = list_next (e);
-    if (e == list_end (&cache_list))
-      e = list_begin (&cache_list);
+  return dirty_victim;
+}
+
+/* Picks a victim from a1_list while it is over its share of the
+   cache, otherwise from am_list, falling back to the other list if
+   every block on the chosen one is pinned. */
+static struct cached_block *
+evict_2q (void)
+{
+  struct list *first = &a1_list, *second = &am_list;
+  struct cached_block *cb;
+
+  if (a1_count <= entry_count / 4 && !list_empty (&am_list))
+  {
+    first = &am_list;
+    second = &a1_list;
   }
 
+  cb = scan_victim (first);
+  if (cb == NULL)
+    cb = scan_victim (second);
   return cb;
+}
 
+/* Returns the oldest clean unpinned block in LIST, or if there is
+   none the oldest dirty unpinned one, or a null pointer. */
+static struct cached_block *
+scan_victim (struct list *list)
+{
+  struct cached_block *dirty_victim = NULL;
+  struct list_elem *le;
+
+  for (le = list_begin (list); le != list_end (list); le = list_next (le))
+  {
+    struct cached_block *cb = list_entry (le, struct cached_block, elem);
+
+    if (cb->open > 0)
+      continue;
+    else if (!cb->dirty)
+      return cb;
+    else if (dirty_victim == NULL)
+      dirty_victim = cb;
+  }
+
+  return dirty_victim;
+}
+
+/* Remembers that SECTOR was evicted from a1_list, forgetting the
+   oldest ghost if there are too many.  Must be called with
+   cache_lock held. */
+static void
+add_ghost (block_sector_t sector)
+{
+  struct cache_ghost *g;
+
+  if (ghost_count >= entry_count / 2 && ghost_count > 0)
+  {
+    g = list_entry (list_pop_front (&ghost_list), struct cache_ghost, elem);
+    hash_delete (&ghost_map, &g->hash_elem);
+    ghost_count--;
+  }
+  else
+  {
+    g = malloc (sizeof *g);
+    if (g == NULL)
+      return;
+  }
+
+  g->sector = sector;
+  if (hash_insert (&ghost_map, &g->hash_elem) != NULL)
+  {
+    /* SECTOR is a ghost already. */
+    free (g);
+    return;
+  }
+  list_push_back (&ghost_list, &g->elem);
+  ghost_count++;
+}
+
+/* If SECTOR is a ghost, forgets it and returns true.  Otherwise
+   returns false.  Must be called with cache_lock held. */
+static bool
+take_ghost (block_sector_t sector)
+{
+  struct cache_ghost key, *g;
+  struct hash_elem *he;
+
+  key.sector = sector;
+  he = hash_delete (&ghost_map, &key.hash_elem);
+  if (he == NULL)
+    return false;
+
+  g = hash_entry (he, struct cache_ghost, hash_elem);
+  list_remove (&g->elem);
+  ghost_count--;
+  free (g);
+  return true;
+}
+
+/* Writes CB to disk.  The caller must have pinned CB and marked it
+   clean, and must not hold cache_lock. */
+static void
+write_back_cache_block (struct cached_block *cb)
+{
+  lock_acquire (&cb->lock);
+  block_write (fs_device, cb->sector, cb->data);
+  lock_release (&cb->lock);
+}
+
+/* Writes the CNT blocks in RUN, which hold consecutive sectors, to
+   disk with a single multi-sector request.  Each block's data is
+   copied out under its own lock, so no block stays locked for the
+   duration of the write.  The caller must hold flush_lock and must
+   otherwise meet the requirements of write_back_cache_block(). */
+static void
+write_back_cache_run (struct cached_block **run, int cnt)
+{
+  int i;
+
+  if (cnt == 1)
+  {
+    write_back_cache_block (run[0]);
+    return;
+  }
+
+  for (i = 0; i < cnt; i++)
+  {
+    lock_acquire (&run[i]->lock);
+    memcpy (flush_buffer + i * BLOCK_SECTOR_SIZE, run[i]->data,
+            BLOCK_SECTOR_SIZE);
+    lock_release (&run[i]->lock);
+  }
+  block_write_multiple (fs_device, run[0]->sector, cnt, flush_buffer);
+}
+
+/* Drops a pin on CB, waking a thread waiting for a victim if it was
+   the last one.  Must be called with cache_lock held. */
+static void
+unpin_cache_block (struct cached_block *cb)
+{
+  ASSERT (cb->open > 0);
+  if (--cb->open == 0)
+    cond_signal (&cache_unpinned, &cache_lock);
+}
+
+/* Marks CB dirty.  Must be called with cache_lock held. */
+static void
+mark_dirty (struct cached_block *cb)
+{
+  if (!cb->dirty)
+  {
+    cb->dirty = true;
+    list_push_back (&dirty_list, &cb->dirty_elem);
+  }
+}
+
+/* Marks CB clean.  Must be called with cache_lock held. */
+static void
+mark_clean (struct cached_block *cb)
+{
+  if (cb->dirty)
+  {
+    cb->dirty = false;
+    list_remove (&cb->dirty_elem);
+  }
 }
 
 
@@ -123,60 +894,209 @@ write_behind_thread (void *aux UNUSED)
   while (true)
   {
     timer_sleep (WRITE_SLEEP_INTERVAL);
+    inode_flush ();
+    free_map_flush ();
     cache_write_behind ();
+
+    /* Blocks written back just now are clean, so this is the best
+       time to give memory back. */
+    lock_acquire (&cache_lock);
+    shrink_cache ();
+    lock_release (&cache_lock);
   }
 }
 
 
+/* Queues SECTOR to be brought into the cache in the background.
+   Never waits for disk I/O; the request is dropped if SECTOR is
+   already cached or the queue is full. */
 void
-cache_write_behind (void)
+cache_read_ahead (block_sector_t sector)
 {
+  bool cached;
+
+  if (read_ahead_window <= 0)
+    return;
+
   lock_acquire (&cache_lock);
-  struct list_elem *e;
+  cached = lookup_cache (sector) != NULL;
+  lock_release (&cache_lock);
+  if (cached)
+    return;
 
-  e = list_begin (&cache_list);
+  lock_acquire (&read_ahead_lock);
+  if (read_ahead_count < READ_AHEAD_QUEUE_SIZE)
+  {
+    int tail = (read_ahead_head + read_ahead_count) % READ_AHEAD_QUEUE_SIZE;
+    read_ahead_queue[tail] = sector;
+    read_ahead_count++;
+    cond_signal (&read_ahead_cond, &read_ahead_lock);
+  }
+  lock_release (&read_ahead_lock);
+}
 
-  //for (e = list_begin (&cache_list); e != list_end (&cache_lock);)// e = list_next (e))
-  while (e != list_end (&cache_list))
+/* Reads queued sectors into the cache, so that sequential readers
+   find them there instead of waiting on block_read().  Requests
+   for consecutive sectors are taken off the queue together and
+   read with one multi-sector request. */
+void
+read_ahead_thread (void *aux UNUSED)
+{
+  while (true)
   {
-    struct cached_block *cb = list_entry (e, struct cached_block, elem);
+    block_sector_t sector;
+    block_sector_t cnt = 0;
 
-    if (cb->dirty)
+    lock_acquire (&read_ahead_lock);
+    while (read_ahead_count == 0)
+      cond_wait (&read_ahead_cond, &read_ahead_lock);
+    sector = read_ahead_queue[read_ahead_head];
+    do
     {
-      cb->dirty = false;
-      block_write (fs_device, cb->sector, &(cb->data));
-      e = list_next (e);
-      //list_remove (&cb->elem);
-      //free (cb);
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+      read_ahead_count--;
+      cnt++;
     }
-    else
-      e = list_next (e);
+    while (read_ahead_count > 0 && cnt < CACHE_RUN_SECTORS
+           && read_ahead_queue[read_ahead_head] == sector + cnt);
+    lock_release (&read_ahead_lock);
+
+    load_cache_run (sector, cnt);
   }
-  lock_release (&cache_lock);
 }
 
+
+/* Writes every dirty block back to disk.  The blocks dirty at the
+   start of the pass are taken off dirty_list together and written
+   in ascending sector order, so the disk head sweeps across them
+   once instead of seeking back and forth, and blocks that hold
+   consecutive sectors go out in a single request. */
 void
-cache_flush (void)
+cache_write_behind (void)
 {
-  lock_acquire (&cache_lock);
+  struct list batch;
   struct list_elem *e;
+  struct cached_block *run[CACHE_RUN_SECTORS];
+  int cnt, i;
 
-  e = list_begin (&cache_list);
+  lock_acquire (&flush_lock);
+  list_init (&batch);
 
-  //for (e = list_begin (&cache_list); e != list_end (&cache_lock);)// e = list_next (e))
-  while (e != list_end (&cache_list))
+  lock_acquire (&cache_lock);
+  while (!list_empty (&dirty_list))
   {
-    struct cached_block *cb = list_entry (e, struct cached_block, elem);
+    struct cached_block *cb = list_entry (list_front (&dirty_list),
+                                          struct cached_block, dirty_elem);
+    mark_clean (cb);
+    cb->open++;
+    stats.flushes++;
+    list_push_back (&batch, &cb->flush_elem);
+  }
+  lock_release (&cache_lock);
 
-    if (cb->dirty)
+  list_sort (&batch, cache_sector_less, NULL);
+  e = list_begin (&batch);
+  while (e != list_end (&batch))
+  {
+    cnt = 0;
+    do
     {
-      cb->dirty = false;
-      block_write (fs_device, cb->sector, &(cb->data));
+      run[cnt++] = list_entry (e, struct cached_block, flush_elem);
+      e = list_next (e);
     }
-    e = list_next (e);
-    list_remove (&cb->elem);
-    free (cb);
+    while (e != list_end (&batch) && cnt < CACHE_RUN_SECTORS
+           && list_entry (e, struct cached_block, flush_elem)->sector
+              == run[cnt - 1]->sector + 1);
+
+    write_back_cache_run (run, cnt);
+    lock_acquire (&cache_lock);
+    for (i = 0; i < cnt; i++)
+      unpin_cache_block (run[i]);
+    lock_release (&cache_lock);
   }
+  lock_release (&flush_lock);
+}
+
+/* Writes all dirty blocks back to disk, at file system shutdown. */
+void
+cache_flush (void)
+{
+  cache_write_behind ();
+}
+
+/* Copies the cache's counters into STATS_. */
+void
+cache_get_stats (struct cache_stats *stats_)
+{
+  lock_acquire (&cache_lock);
+  *stats_ = stats;
   lock_release (&cache_lock);
 }
 
+/* Prints buffer cache statistics.  Does not take cache_lock, so
+   that it is safe to call from shutdown_power_off(). */
+void
+cache_print_stats (void)
+{
+  if (fs_device == NULL)
+    return;
+
+  printf ("%s (cache): %llu hits, %llu misses, "
+          "%llu clean and %llu dirty evictions, %llu flushes\n",
+          block_name (fs_device), stats.hits, stats.misses,
+          stats.clean_evictions, stats.dirty_evictions, stats.flushes);
+  printf ("%s (cache): %llu blocks read ahead, %llu used, %llu wasted, "
+          "%llu direct\n",
+          block_name (fs_device), stats.read_aheads, stats.read_ahead_hits,
+          stats.read_ahead_wasted, stats.direct);
+}
+
+/* Orders blocks in a write-behind batch by sector number. */
+static bool
+cache_sector_less (const struct list_elem *a_, const struct list_elem *b_,
+                   void *aux UNUSED)
+{
+  const struct cached_block *a = list_entry (a_, struct cached_block, flush_elem);
+  const struct cached_block *b = list_entry (b_, struct cached_block, flush_elem);
+
+  return a->sector < b->sector;
+}
+
+/* Hashes a cached block by its sector number. */
+unsigned
+cache_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cached_block *cb = hash_entry (e, struct cached_block, hash_elem);
+  return hash_int (cb->sector);
+}
+
+/* Hashes a ghost by its sector number. */
+static unsigned
+ghost_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_ghost *g = hash_entry (e, struct cache_ghost, hash_elem);
+  return hash_int (g->sector);
+}
+
+/* Orders ghosts by sector number. */
+static bool
+ghost_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct cache_ghost *a = hash_entry (a_, struct cache_ghost, hash_elem);
+  const struct cache_ghost *b = hash_entry (b_, struct cache_ghost, hash_elem);
+
+  return a->sector < b->sector;
+}
+
+/* Orders cached blocks by sector number. */
+bool
+cache_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct cached_block *a = hash_entry (a_, struct cached_block, hash_elem);
+  const struct cached_block *b = hash_entry (b_, struct cached_block, hash_elem);
+
+  return a->sector < b->sector;
+}
+
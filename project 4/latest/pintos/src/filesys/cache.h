@@ -4,27 +4,80 @@
 #include "devices/block.h"
 #include "threads/synch.h"
 #include <list.h>
+#include <hash.h>
+#include <cache-stats.h>
+#include "threads/vaddr.h"
 
-#define MAX_CACHE_SIZE 64
+#define MIN_CACHE_SIZE 64		/* Cache never shrinks below this. */
+/* The cache shrinks when fewer than CACHE_LOW_PAGES kernel pages
+   are free, and only grows while more than twice that many are. */
+#define CACHE_LOW_PAGES 32
+#define BLOCKS_PER_CHUNK (PGSIZE / BLOCK_SECTOR_SIZE)
+/* Ticks between write-behind passes.  Bounds how much written
+   data can be lost in a crash. */
 #define WRITE_SLEEP_INTERVAL 500
+#define READ_AHEAD_WINDOW 8		/* Default read-ahead, in sectors. */
+#define READ_AHEAD_QUEUE_SIZE 64	/* Max queued read-ahead requests. */
+#define CACHE_RUN_SECTORS 32		/* Max sectors per multi-sector request. */
+
+/* Number of sectors to read ahead of a sequential reader.
+   Set by kernel command-line option "-ra=N"; 0 disables it. */
+extern int read_ahead_window;
+
+/* Most sectors the cache may hold.  Set by kernel command-line
+   option "-cache=N"; by default it may use a quarter of the kernel
+   pool. */
+extern int cache_size_limit;
+
+/* Buffer cache replacement policies, see cache.c. */
+enum cache_policy
+  {
+    CACHE_CLOCK,			/* One-bit clock. */
+    CACHE_2Q				/* Scan-resistant 2Q. */
+  };
+
+/* Set by kernel command-line option "-cache-policy=clock|2q". */
+extern enum cache_policy cache_policy;
 
 
 struct cached_block
   {
     block_sector_t sector;
-    uint8_t data[BLOCK_SECTOR_SIZE];
+    uint8_t *data;			/* Slot in its chunk's page. */
     bool accessed;
     bool dirty;
-    int open;
-    struct list_elem elem;
+    bool loading;			/* True while being read from disk. */
+    bool free;				/* In free_list, not in cache_map. */
+    bool read_ahead;			/* Read ahead and not used yet. */
+    bool metadata;			/* Holds file system metadata. */
+    bool hot;				/* 2Q: on am_list, not a1_list. */
+    int open;				/* Pin count, see cache.c. */
+    struct lock lock;			/* Protects data and dirty. */
+    struct list_elem elem;		/* Element in a replacement list
+					   or free_list. */
+    struct list_elem dirty_elem;	/* Element in dirty_list. */
+    struct list_elem flush_elem;	/* Element in a write-behind batch. */
+    struct hash_elem hash_elem;		/* Element in cache_map (keyed by sector). */
   };
 
 void cache_init (void);
 struct cached_block * get_cached_block (block_sector_t, bool);
+void release_cached_block (struct cached_block *, bool);
+void cache_read (block_sector_t, void *, int, int, bool);
+void cache_write (block_sector_t, const void *, int, int, bool);
+void cache_read_direct (block_sector_t, block_sector_t, void *);
+void cache_write_direct (block_sector_t, block_sector_t, const void *);
 struct cached_block * lookup_cache (block_sector_t);
 struct cached_block * evict_cache_block (void);
 void write_behind_thread (void *);
+void read_ahead_thread (void *);
+void cache_read_ahead (block_sector_t);
 void cache_write_behind (void);
 void cache_flush (void);
+void cache_get_stats (struct cache_stats *);
+void cache_print_stats (void);
+unsigned cache_hash_func (const struct hash_elem *, void *);
+bool cache_less_func (const struct hash_elem *, const struct hash_elem *,
+                      void *);
 
 #endif
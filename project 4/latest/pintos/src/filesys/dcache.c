@@ -0,0 +1,181 @@
+#include "filesys/dcache.h"
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Path-lookup cache.
+
+   Maps a directory's inode sector and a name in it to the sector
+   of the inode that the name refers to, or to DCACHE_NEGATIVE if
+   the directory has no such entry, so that resolving a path whose
+   prefix was resolved recently does not read directory data.
+
+   The directory code keeps it coherent: dir_lookup() fills it in,
+   dir_add() and dir_remove() update the entry for the name they
+   change while holding the directory's lock, and removing a
+   directory purges every entry under it, since its sector may be
+   reused for a different directory.
+
+   Entries are kept in LRU order and the least recently used one is
+   recycled once there are DCACHE_SIZE of them.  dcache_lock
+   protects everything here. */
+
+struct dcache_entry
+  {
+    block_sector_t parent;		/* Directory inode sector. */
+    char name[NAME_MAX + 1];		/* Name within it. */
+    block_sector_t sector;		/* Inode, or DCACHE_NEGATIVE. */
+    struct hash_elem hash_elem;		/* Element in dcache_map. */
+    struct list_elem elem;		/* Element in lru_list. */
+  };
+
+static struct hash dcache_map;
+static struct list lru_list;		/* Most recently used at front. */
+static size_t dcache_count;
+static struct lock dcache_lock;
+
+static struct dcache_entry *find_entry (block_sector_t, const char *);
+static unsigned dcache_hash_func (const struct hash_elem *, void *);
+static bool dcache_less_func (const struct hash_elem *,
+                              const struct hash_elem *, void *);
+
+void
+dcache_init (void)
+{
+  hash_init (&dcache_map, dcache_hash_func, dcache_less_func, NULL);
+  list_init (&lru_list);
+  dcache_count = 0;
+  lock_init (&dcache_lock);
+}
+
+/* Looks up NAME in the directory whose inode is in sector PARENT.
+   Returns false if the cache does not know.  Otherwise returns
+   true and sets *SECTOR to the sector of NAME's inode, or to
+   DCACHE_NEGATIVE if NAME does not exist. */
+bool
+dcache_lookup (block_sector_t parent, const char *name,
+               block_sector_t *sector)
+{
+  struct dcache_entry *de;
+
+  lock_acquire (&dcache_lock);
+  de = find_entry (parent, name);
+  if (de != NULL)
+    {
+      *sector = de->sector;
+      list_remove (&de->elem);
+      list_push_front (&lru_list, &de->elem);
+    }
+  lock_release (&dcache_lock);
+  return de != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in sector
+   PARENT refers to SECTOR, which may be DCACHE_NEGATIVE.  Names
+   too long to exist are not recorded. */
+void
+dcache_insert (block_sector_t parent, const char *name,
+               block_sector_t sector)
+{
+  struct dcache_entry *de;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  de = find_entry (parent, name);
+  if (de != NULL)
+    list_remove (&de->elem);
+  else
+    {
+      if (dcache_count < DCACHE_SIZE)
+        de = malloc (sizeof *de);
+      if (de != NULL)
+        dcache_count++;
+      else if (!list_empty (&lru_list))
+        {
+          /* Recycle the least recently used entry. */
+          de = list_entry (list_pop_back (&lru_list),
+                           struct dcache_entry, elem);
+          hash_delete (&dcache_map, &de->hash_elem);
+        }
+      if (de == NULL)
+        {
+          lock_release (&dcache_lock);
+          return;
+        }
+      de->parent = parent;
+      strlcpy (de->name, name, sizeof de->name);
+      hash_insert (&dcache_map, &de->hash_elem);
+    }
+  de->sector = sector;
+  list_push_front (&lru_list, &de->elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name in the directory whose inode is in sector
+   PARENT. */
+void
+dcache_purge (block_sector_t parent)
+{
+  struct list_elem *e;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru_list); e != list_end (&lru_list);)
+    {
+      struct dcache_entry *de = list_entry (e, struct dcache_entry, elem);
+
+      e = list_next (e);
+      if (de->parent == parent)
+        {
+          list_remove (&de->elem);
+          hash_delete (&dcache_map, &de->hash_elem);
+          free (de);
+          dcache_count--;
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in PARENT, or a null pointer if there
+   is none.  Must be called with dcache_lock held. */
+static struct dcache_entry *
+find_entry (block_sector_t parent, const char *name)
+{
+  struct dcache_entry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dcache_entry, hash_elem) : NULL;
+}
+
+/* Hashes an entry by directory and name. */
+static unsigned
+dcache_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dcache_entry *de = hash_entry (e, struct dcache_entry,
+                                              hash_elem);
+  return hash_string (de->name) ^ hash_int (de->parent);
+}
+
+/* Orders entries by directory, then by name. */
+static bool
+dcache_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                  void *aux UNUSED)
+{
+  const struct dcache_entry *a = hash_entry (a_, struct dcache_entry,
+                                             hash_elem);
+  const struct dcache_entry *b = hash_entry (b_, struct dcache_entry,
+                                             hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
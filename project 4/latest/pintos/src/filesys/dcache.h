@@ -0,0 +1,21 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Most names the path-lookup cache holds. */
+#define DCACHE_SIZE 512
+
+/* Sector recorded for a name known not to exist.  Sector 0 holds
+   the free map's inode, so no directory entry ever refers to it. */
+#define DCACHE_NEGATIVE 0
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t parent, const char *name,
+                    block_sector_t *sector);
+void dcache_insert (block_sector_t parent, const char *name,
+                    block_sector_t sector);
+void dcache_purge (block_sector_t parent);
+
+#endif /* filesys/dcache.h */
@@ -2,13 +2,70 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
+#include <round.h>
+#include <dirent.h>
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
 #include "filesys/inode.h"
+#include "filesys/dcache.h"
 #include "threads/malloc.h"
 #include "threads/vaddr.h"
 
 /* Start of Project 4 */
 bool check_if_dir_empty (struct inode *);
+
+/* A directory starts out as a plain array of struct dir_entry,
+   which is the cheapest format for the common small directory.
+   When a directory with DIR_LINEAR_MAX or more slots runs out of
+   free slots, it is converted to an indexed format:
+
+     - Its first sector is a struct dir_index that maps the low
+       DIR_INDEX_BITS bits of the hash of a name to the bucket
+       that holds it.
+
+     - Every later sector is a struct dir_bucket of entries.
+
+   This is extendible hashing: a full bucket with local depth D is
+   split into two buckets of depth D + 1 and only the index slots
+   that pointed to it are updated.  Once a bucket reaches depth
+   DIR_INDEX_BITS it cannot be split further and grows a chain of
+   overflow buckets instead.  Buckets are never freed; new ones go
+   at the end of the directory. */
+#define DIR_INDEX_MAGIC 0x58444944	/* Marks an indexed directory. */
+#define DIR_INDEX_BITS 6		/* Hash bits used to pick a bucket. */
+#define DIR_INDEX_SLOTS (1 << DIR_INDEX_BITS)
+#define DIR_BUCKET_ENTRIES 25		/* Entries per bucket sector. */
+#define DIR_LINEAR_MAX DIR_BUCKET_ENTRIES	/* Slots before indexing. */
+
+/* First sector of an indexed directory.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_index
+  {
+    uint32_t magic;			/* DIR_INDEX_MAGIC. */
+    uint32_t bucket_end;		/* Sectors in use, this one included. */
+    uint32_t slots[DIR_INDEX_SLOTS];	/* Bucket sector for each hash. */
+    uint32_t unused[62];		/* Not used. */
+  };
+
+/* A bucket of an indexed directory.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_bucket
+  {
+    struct dir_entry entries[DIR_BUCKET_ENTRIES];	/* Entries. */
+    uint32_t depth;			/* Hash bits its entries share. */
+    uint32_t next;			/* Overflow bucket sector, or 0. */
+    uint32_t unused;			/* Not used. */
+  };
+
+static off_t index_end (struct inode *);
+static bool index_lookup (struct inode *, const char *,
+                          struct dir_entry *, off_t *);
+static bool index_add (struct inode *, const struct dir_entry *);
+static bool convert_to_index (struct inode *);
+static bool next_entry (struct inode *, off_t *, struct dir_entry *);
+static size_t read_entries (struct inode *, off_t, off_t *,
+                            struct dir_entry *, size_t);
 /* End of Project 4 */
 
 /* Creates a directory with space for ENTRY_CNT entries in the
@@ -90,6 +147,10 @@ lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  /* Start of Project 4 */
+  if (index_end (dir->inode) != 0)
+    return index_lookup (dir->inode, name, ep, ofsp);
+  /* End of Project 4 */
 
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
@@ -113,15 +174,29 @@ dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
   struct dir_entry e;
+  /* Start of Project 4 */
+  block_sector_t parent = inode_get_inumber (dir->inode);
+  block_sector_t sector;
+  /* End of Project 4 */
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
   
   lock_acquire_inode (dir->inode);			/* Project 4 */
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  /* Start of Project 4 */
+  if (dcache_lookup (parent, name, &sector))
+    *inode = sector != DCACHE_NEGATIVE ? inode_open (sector) : NULL;
+  else if (lookup (dir, name, &e, NULL))
+    {
+      dcache_insert (parent, name, e.inode_sector);
+      *inode = inode_open (e.inode_sector);
+    }
   else
-    *inode = NULL;
+    {
+      dcache_insert (parent, name, DCACHE_NEGATIVE);
+      *inode = NULL;
+    }
+  /* End of Project 4 */
 
   lock_release_inode (dir->inode);			/* Project 4 */
   return *inode != NULL;
@@ -165,25 +240,46 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   inode_close (child_inode);
   /* End of Project 4 */
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+  /* Start of Project 4 */
+  if (index_end (dir->inode) == 0)
+    {
+      /* Set OFS to offset of free slot.
+         If there are no free slots, then it will be set to the
+         current end-of-file.
+
+         inode_read_at() will only return a short read at end of file.
+         Otherwise, we'd need to verify that we didn't get a short
+         read due to something intermittent such as low memory. */
+      for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+           ofs += sizeof e) 
+        if (!e.in_use)
+          break;
+
+      /* Write slot, unless the directory has outgrown the linear
+         format. */
+      e.in_use = true;
+      strlcpy (e.name, name, sizeof e.name);
+      e.inode_sector = inode_sector;
+      if (ofs < (off_t) (DIR_LINEAR_MAX * sizeof e))
+        {
+          success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+          goto done;
+        }
+      if (!convert_to_index (dir->inode))
+        goto done;
+    }
 
-  /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  success = index_add (dir->inode, &e);
+  /* End of Project 4 */
 
  done:
+  /* Start of Project 4 */
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+  /* End of Project 4 */
   lock_release_inode (dir->inode);			/* Project 4 */
   return success;
 }
@@ -230,6 +326,12 @@ dir_remove (struct dir *dir, const char *name)
   inode_remove (inode);
   success = true;
 
+  /* Start of Project 4 */
+  dcache_insert (inode_get_inumber (dir->inode), name, DCACHE_NEGATIVE);
+  if (inode_is_dir (inode))
+    dcache_purge (inode_get_inumber (inode));
+  /* End of Project 4 */
+
  done:
   inode_close (inode);
   lock_release_inode (dir->inode);			/* Project 4 */
@@ -244,23 +346,86 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
 
-  lock_acquire_inode (dir->inode);			/* Project 4 */
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
-    {
-      dir->pos += sizeof e;
-      if (e.in_use)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          lock_release_inode (dir->inode);		/* Project 4 */
-          return true;
-        } 
-    }
-  lock_release_inode (dir->inode);			/* Project 4 */
-  return false;
+  /* Start of Project 4 */
+  bool success;
+
+  lock_acquire_inode (dir->inode);
+  success = next_entry (dir->inode, &dir->pos, &e);
+  if (success)
+    strlcpy (name, e.name, NAME_MAX + 1);
+  lock_release_inode (dir->inode);
+  return success;
+  /* End of Project 4 */
 }
 
 /* Start of Prject 4 */
 
+/* Reads up to CNT of the entries of DIR that follow the last one
+   read into ENTS, a sector's worth of slots at a time, and returns
+   the number read, 0 at the end of DIR, or -1 if memory is short.
+   Each entry gets its name and inumber; with ATTRS, also its type
+   and size, which means opening its inode, or OPEN_FAILED if that
+   fails.  Every entry's inode sector is queued for read-ahead as
+   it is found, so those opens, and the caller's, mostly hit the
+   cache.  The opens come after DIR's lock is released, so that
+   lookups in DIR do not wait on them; an entry removed meanwhile
+   may come back with OPEN_FAILED set. */
+int
+dir_readdir_multiple (struct dir *dir, struct dirent *ents, int cnt,
+                      bool attrs)
+{
+  struct dir_entry *buf = malloc (DIR_BUCKET_ENTRIES * sizeof *buf);
+  off_t end;
+  size_t slots, i;
+  int n = 0, j;
+
+  if (buf == NULL)
+    return -1;
+
+  lock_acquire_inode (dir->inode);
+  end = index_end (dir->inode);
+  while (n < cnt
+         && (slots = read_entries (dir->inode, end, &dir->pos,
+                                   buf, DIR_BUCKET_ENTRIES)) > 0)
+    {
+      off_t base = dir->pos - slots * sizeof *buf;
+
+      for (i = 0; i < slots && n < cnt; i++)
+        if (buf[i].in_use)
+          {
+            strlcpy (ents[n].name, buf[i].name, sizeof ents[n].name);
+            ents[n].inumber = buf[i].inode_sector;
+            ents[n].is_dir = false;
+            ents[n].size = 0;
+            ents[n].open_failed = false;
+            cache_read_ahead (buf[i].inode_sector);
+            n++;
+          }
+
+      /* Leave the rest of the slots for the next call. */
+      if (n == cnt)
+        dir->pos = base + i * sizeof *buf;
+    }
+  lock_release_inode (dir->inode);
+  free (buf);
+
+  if (attrs)
+    for (j = 0; j < n; j++)
+      {
+        struct inode *inode = inode_open (ents[j].inumber);
+
+        if (inode != NULL)
+          {
+            ents[j].is_dir = inode_is_dir (inode);
+            ents[j].size = inode_length (inode);
+            inode_close (inode);
+          }
+        else
+          ents[j].open_failed = true;
+      }
+  return n;
+}
+
 bool 
 check_if_root_dir (struct dir *dir)
 {
@@ -289,13 +454,244 @@ check_if_dir_empty (struct inode *dir_node)
   off_t ofs = 0;
   struct dir_entry de;
 
-  while (inode_read_at (dir_node, &de, sizeof de, ofs) == sizeof de)
-  {
-    if (de.in_use)
-      return false;
-    ofs += sizeof de;
-  } 
+  return !next_entry (dir_node, &ofs, &de);
+}
 
-  return true;
+/* Returns the end of the buckets of indexed directory INODE, in
+   bytes, or 0 if INODE is in the linear format. */
+static off_t
+index_end (struct inode *inode)
+{
+  uint32_t head[2];
+
+  if (inode_length (inode) < BLOCK_SECTOR_SIZE
+      || inode_read_at (inode, head, sizeof head, 0) != sizeof head
+      || head[0] != DIR_INDEX_MAGIC)
+    return 0;
+  return head[1] * BLOCK_SECTOR_SIZE;
+}
+
+/* Reads the next in-use entry of directory INODE at or after byte
+   offset *POS into *E and advances *POS past it.  Returns false if
+   there are no more entries. */
+static bool
+next_entry (struct inode *inode, off_t *pos, struct dir_entry *e)
+{
+  off_t end = index_end (inode);
+
+  while (read_entries (inode, end, pos, e, 1) == 1)
+    if (e->in_use)
+      return true;
+  return false;
+}
+
+/* Reads up to CNT consecutive entry slots of directory INODE, in
+   use or not, at or after byte offset *POS into ENTRIES and
+   advances *POS past them.  END is INODE's index_end().  Stops at
+   the end of a bucket, so that the slots read are all entries.
+   Returns the number read, 0 at the end of the directory. */
+static size_t
+read_entries (struct inode *inode, off_t end, off_t *pos,
+              struct dir_entry *entries, size_t cnt)
+{
+  const off_t bucket_size = DIR_BUCKET_ENTRIES * sizeof *entries;
+
+  /* Skip the index and the tail of each bucket. */
+  if (end != 0)
+    {
+      if (*pos < BLOCK_SECTOR_SIZE)
+        *pos = BLOCK_SECTOR_SIZE;
+      if (*pos % BLOCK_SECTOR_SIZE >= bucket_size)
+        *pos = ROUND_UP (*pos, BLOCK_SECTOR_SIZE);
+      if (*pos >= end)
+        return 0;
+      if (cnt > (bucket_size - *pos % BLOCK_SECTOR_SIZE) / sizeof *entries)
+        cnt = (bucket_size - *pos % BLOCK_SECTOR_SIZE) / sizeof *entries;
+    }
+
+  cnt = inode_read_at (inode, entries, cnt * sizeof *entries, *pos)
+        / sizeof *entries;
+  *pos += cnt * sizeof *entries;
+  return cnt;
+}
+
+/* Reads bucket BLOCK of indexed directory INODE into B. */
+static bool
+read_bucket (struct inode *inode, uint32_t block, struct dir_bucket *b)
+{
+  return inode_read_at (inode, b, sizeof *b,
+                        block * BLOCK_SECTOR_SIZE) == sizeof *b;
+}
+
+/* Writes B to bucket BLOCK of indexed directory INODE. */
+static bool
+write_bucket (struct inode *inode, uint32_t block,
+              const struct dir_bucket *b)
+{
+  return inode_write_at (inode, b, sizeof *b,
+                         block * BLOCK_SECTOR_SIZE) == sizeof *b;
+}
+
+/* Indexed version of lookup(): searches only the bucket chain that
+   NAME hashes to. */
+static bool
+index_lookup (struct inode *inode, const char *name,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_bucket b;
+  uint32_t block;
+  off_t slot = offsetof (struct dir_index, slots)
+               + hash_string (name) % DIR_INDEX_SLOTS * sizeof block;
+  size_t i;
+
+  if (inode_read_at (inode, &block, sizeof block, slot) != sizeof block)
+    return false;
+
+  for (; block != 0 && read_bucket (inode, block, &b); block = b.next)
+    for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+      if (b.entries[i].in_use && !strcmp (name, b.entries[i].name))
+        {
+          if (ep != NULL)
+            *ep = b.entries[i];
+          if (ofsp != NULL)
+            *ofsp = block * BLOCK_SECTOR_SIZE + i * sizeof *b.entries;
+          return true;
+        }
+  return false;
+}
+
+/* Returns the index of a free entry in B, or DIR_BUCKET_ENTRIES if
+   B is full. */
+static size_t
+free_entry (const struct dir_bucket *b)
+{
+  size_t i;
+
+  for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+    if (!b->entries[i].in_use)
+      break;
+  return i;
+}
+
+/* Adds E to indexed directory INODE, splitting or chaining a
+   bucket if the one E hashes to is full.  Returns true if
+   successful, false on failure. */
+static bool
+index_add (struct inode *inode, const struct dir_entry *e)
+{
+  struct dir_index *idx = malloc (sizeof *idx);
+  struct dir_bucket *b = malloc (sizeof *b);
+  struct dir_bucket *nb = malloc (sizeof *nb);
+  unsigned hash = hash_string (e->name);
+  bool success = false;
+
+  while (idx != NULL && b != NULL && nb != NULL
+         && inode_read_at (inode, idx, sizeof *idx, 0) == sizeof *idx)
+    {
+      uint32_t block = idx->slots[hash % DIR_INDEX_SLOTS];
+      uint32_t new_block;
+      size_t i;
+      bool chained;
+
+      /* Find the first bucket in the chain with a free entry. */
+      if (!read_bucket (inode, block, b))
+        break;
+      while ((i = free_entry (b)) == DIR_BUCKET_ENTRIES && b->next != 0)
+        {
+          block = b->next;
+          if (!read_bucket (inode, block, b))
+            goto done;
+        }
+      if (i < DIR_BUCKET_ENTRIES)
+        {
+          b->entries[i] = *e;
+          success = write_bucket (inode, block, b);
+          break;
+        }
+
+      /* The bucket is full.  Split it if it has hash bits left,
+         otherwise chain a new bucket to it. */
+      new_block = idx->bucket_end++;
+      memset (nb, 0, sizeof *nb);
+      chained = b->depth >= DIR_INDEX_BITS;
+      if (!chained)
+        {
+          unsigned bit = 1u << b->depth;
+
+          nb->depth = ++b->depth;
+          for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+            if (hash_string (b->entries[i].name) & bit)
+              {
+                nb->entries[i] = b->entries[i];
+                b->entries[i].in_use = false;
+              }
+          for (i = 0; i < DIR_INDEX_SLOTS; i++)
+            if (idx->slots[i] == block && (i & bit))
+              idx->slots[i] = new_block;
+        }
+      else
+        {
+          nb->depth = b->depth;
+          nb->entries[0] = *e;
+          b->next = new_block;
+        }
+
+      /* Write the new bucket before anything points to it. */
+      if (!write_bucket (inode, new_block, nb)
+          || !write_bucket (inode, block, b)
+          || inode_write_at (inode, idx, sizeof *idx, 0) != sizeof *idx)
+        break;
+      if (chained)
+        {
+          success = true;
+          break;
+        }
+    }
+
+ done:
+  free (idx);
+  free (b);
+  free (nb);
+  return success;
+}
+
+/* Converts linear directory INODE to the indexed format.
+   Returns true if successful, false on failure. */
+static bool
+convert_to_index (struct inode *inode)
+{
+  off_t length = inode_length (inode);
+  struct dir_entry *entries = malloc (length);
+  struct dir_index *idx = calloc (1, sizeof *idx);
+  struct dir_bucket *b = calloc (1, sizeof *b);
+  size_t cnt = length / sizeof *entries;
+  size_t i;
+  bool success = false;
+
+  ASSERT (sizeof *idx == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof *b == BLOCK_SECTOR_SIZE);
+
+  if (entries != NULL && idx != NULL && b != NULL
+      && inode_read_at (inode, entries, length, 0) == length)
+    {
+      /* Start with one empty bucket that every slot points to.
+         It is written before the index, which overwrites the old
+         entries, so that failure leaves the directory intact. */
+      idx->magic = DIR_INDEX_MAGIC;
+      idx->bucket_end = 2;
+      for (i = 0; i < DIR_INDEX_SLOTS; i++)
+        idx->slots[i] = 1;
+      success = (write_bucket (inode, 1, b)
+                 && inode_write_at (inode, idx, sizeof *idx, 0) == sizeof *idx);
+
+      for (i = 0; success && i < cnt; i++)
+        if (entries[i].in_use)
+          success = index_add (inode, &entries[i]);
+    }
+
+  free (entries);
+  free (idx);
+  free (b);
+  return success;
 }
 /* End of Project 4 */
@@ -13,6 +13,7 @@
 #define NAME_MAX 14
 
 struct inode;
+struct dirent;
 
 /* A directory. */
 struct dir
@@ -52,6 +53,8 @@ bool lookup (const struct dir *, const char *,
 /* Start of Project 4 */
 bool check_if_root_dir (struct dir *);
 bool retrieve_dir_parent (struct dir *, struct inode **);
+int dir_readdir_multiple (struct dir *, struct dirent *, int cnt,
+                          bool attrs);
 /* End of Project 4 */
 
 #endif /* filesys/directory.h */
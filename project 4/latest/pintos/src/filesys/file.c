@@ -19,6 +19,8 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_pos = 0;				/* Project 4 */
+      file->ra_end = 0;				/* Project 4 */
       return file;
     }
   else
@@ -64,8 +66,18 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
+  bool sequential = file->pos == file->ra_pos;		/* Project 4 */
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
+
+  /* Start of Project 4 */
+  /* Reads that pick up where the previous one left off are streaming
+     through the file, so have the next sectors fetched meanwhile.
+     Reads big enough to bypass the cache do not want it filled. */
+  if (sequential && bytes_read > 0 && size < INODE_DIRECT_MIN)
+    file->ra_end = inode_read_ahead (file->inode, file->pos, file->ra_end);
+  file->ra_pos = file->pos;
+  /* End of Project 4 */
   return bytes_read;
 }
 
@@ -12,6 +12,8 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_pos;               /* Where the last read ended. */
+    off_t ra_end;               /* Read ahead has been issued up to here. */
   };
 /* End of Project 2 */
 
@@ -7,6 +7,7 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "cache.h"
+#include "filesys/dcache.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
@@ -29,6 +30,7 @@ filesys_init (bool format)
 
   inode_init ();
   cache_init ();				/* Project 4 */
+  dcache_init ();				/* Project 4 */
   free_map_init ();
 
   if (format) 
@@ -43,9 +45,12 @@ void
 filesys_done (void) 
 {
   /* Start of Project 4 */
+  /* Pending file data allocates sectors, and the free map is
+     written through the cache, so flush them in that order. */
+  inode_flush ();
+  free_map_close ();
   cache_flush ();
   /* End of Project 4 */
-  free_map_close ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -1,13 +1,30 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
+/* Start of Project 4 */
+/* Changes to the free map are only written to free_map_file by
+   free_map_flush(), and then only the sectors of the file that
+   changed.  dirty_map has a bit for each sector of free_map_file,
+   set if the part of free_map it holds has changed since it was
+   last written. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+static struct bitmap *dirty_map;
+
+/* Protects free_map, dirty_map and free_map_file's contents. */
+static struct lock free_map_lock;
+
+static void mark_dirty (block_sector_t, size_t);
+/* End of Project 4 */
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -17,36 +34,92 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+
+  /* Start of Project 4 */
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           BITS_PER_SECTOR));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
+  /* End of Project 4 */
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+
+  lock_acquire (&free_map_lock);				/* Project 4 */
+  sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      mark_dirty (sector, cnt);					/* Project 4 */
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+  lock_release (&free_map_lock);				/* Project 4 */
   return sector != BITMAP_ERROR;
 }
 
+/* Start of Project 4 */
+/* Allocates up to CNT consecutive sectors and stores the first
+   into *SECTORP, for a file that would like to grow contiguously.
+   The run starting at HINT is taken if HINT is free; otherwise a
+   run at least half as long as the longest free one, or CNT if
+   that is shorter.  Returns the number of sectors allocated, which
+   is 0 if the disk is full. */
+size_t
+free_map_allocate_run (size_t cnt, block_sector_t hint,
+                       block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t want = cnt;
+  size_t got = 0;
+  block_sector_t sector = hint;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (hint >= size || bitmap_test (free_map, hint))
+  {
+    /* Find a run of WANT sectors, halving WANT until one fits. */
+    while ((sector = bitmap_scan (free_map, 0, want, false)) == BITMAP_ERROR)
+    {
+      if (want == 1)
+      {
+        lock_release (&free_map_lock);
+        return 0;
+      }
+      want /= 2;
+    }
+  }
+
+  /* Take as much of the run as is free, up to CNT. */
+  while (got < cnt && sector + got < size
+         && !bitmap_test (free_map, sector + got))
+    got++;
+
+  bitmap_set_multiple (free_map, sector, got, true);
+  mark_dirty (sector, got);
+  lock_release (&free_map_lock);
+
+  *sectorp = sector;
+  return got;
+}
+/* End of Project 4 */
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);				/* Project 4 */
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark_dirty (sector, cnt);					/* Project 4 */
+  lock_release (&free_map_lock);				/* Project 4 */
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -64,6 +137,7 @@ free_map_open (void)
 void
 free_map_close (void) 
 {
+  free_map_flush ();						/* Project 4 */
   file_close (free_map_file);
 }
 
@@ -82,6 +156,7 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);				/* Project 4 */
 }
 
 /* Start of Project 4 */
@@ -89,7 +164,50 @@ free_map_create (void)
 uint32_t
 free_map_count (void)
 {
-  return bimap_free_count (free_map);
+  uint32_t cnt;
+
+  lock_acquire (&free_map_lock);
+  cnt = bimap_free_count (free_map);
+  lock_release (&free_map_lock);
+  return cnt;
+}
+
+/* Writes the sectors of the free map file whose part of the free
+   map has changed.  The writes go through the buffer cache, so
+   the caller should flush the cache afterward to get them to
+   disk. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = 0; i < bitmap_size (dirty_map); i++)
+      if (bitmap_test (dirty_map, i))
+        {
+          size_t start = i * BITS_PER_SECTOR;
+          size_t cnt = bitmap_size (free_map) - start;
+
+          if (cnt > BITS_PER_SECTOR)
+            cnt = BITS_PER_SECTOR;
+          if (!bitmap_write_part (free_map, free_map_file, start, cnt))
+            PANIC ("can't write free map");
+          bitmap_reset (dirty_map, i);
+        }
+  lock_release (&free_map_lock);
+}
+
+/* Notes that the free map bits of the CNT sectors starting at
+   SECTOR have changed.  Must be called with free_map_lock held. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  ASSERT (cnt > 0);
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
 }
 
 /* End of Project 4 */
@@ -14,6 +14,10 @@ void free_map_close (void);
 bool free_map_allocate (size_t, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
 
-uint32_t free_map_count (void);				/* Project 4 */
+/* Start of Project 4 */
+uint32_t free_map_count (void);
+size_t free_map_allocate_run (size_t, block_sector_t, block_sector_t *);
+void free_map_flush (void);
+/* End of Project 4 */
 
 #endif /* filesys/free-map.h */
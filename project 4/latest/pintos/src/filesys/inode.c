@@ -1,16 +1,32 @@
 #include "filesys/inode.h"
 #include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Start of Project 4 */
+/* Sectors of file data that can wait in memory for disk space.
+   Writes into holes that do not fit, and direct writes of at least
+   INODE_DIRECT_MIN bytes, get their sectors at once instead, with
+   fill_hole() writing the data into them. */
+#define PENDING_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Files and directories no longer than this keep their data in
+   the inode sector itself, in place of the extents. */
+#define INODE_INLINE_MAX ((off_t) (INODE_EXTENTS * sizeof (struct extent)))
+/* End of Project 4 */
+
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
@@ -20,16 +36,32 @@ struct inode_disk
     //block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     bool is_dir;			/* Specify if inode is for directory. */
+    bool is_inline;			/* Data is in `data', not extents. */
     block_sector_t parent;		/* Sector of parent inode. */
     unsigned magic;                     /* Magic number. */
-    block_sector_t ptrs[MAX_BLOCK_INODE];	/* Block sector pointers of file. */
-    uint32_t dir_index;			/* Next Direct index. */
-    uint32_t indir_index;		/* Next indirect index. */
-    uint32_t double_indir_index;	/* Next double indirect index. */
-    uint32_t unused[106];               /* Not used. */
+    uint32_t extent_cnt;		/* Number of extents, in file order. */
+    block_sector_t overflow;		/* First overflow extent block. */
+    union
+      {
+        struct extent extents[INODE_EXTENTS];	/* First extents of file. */
+        uint8_t data[INODE_INLINE_MAX];		/* Or all of its data. */
+      };
+    uint32_t unused[2];                 /* Not used. */
     /* End of Project 4 */
   };
 
+/* Start of Project 4 */
+/* Holds the extents of a file past the first INODE_EXTENTS.
+   Overflow blocks form a chain starting at the inode's `overflow'.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_block
+  {
+    block_sector_t next;		/* Next overflow block, if any. */
+    uint32_t unused;			/* Not used. */
+    struct extent extents[EXTENT_BLOCK_EXTENTS];
+  };
+/* End of Project 4 */
+
 bool inode_alloc (struct inode_disk *);	/* Project 4 */
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -40,92 +72,163 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
+/* Start of Project 4 */
+/* What open_inodes is searched by.  Its members must stay the first
+   ones of struct inode, in the same order, since the hash functions
+   see every element as one of these. */
+struct inode_key
+  {
+    struct hash_elem elem;		/* Element in open_inodes. */
+    block_sector_t sector;		/* Sector number of disk location. */
+  };
+/* End of Project 4 */
+
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool busy;				/* Being read in or written back.
+					   Project 4 */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     /* Start of Project 4 */
     //struct inode_disk data;             /* Inode content. */
     struct lock lock;			/* Lock for synchronization. */
-    uint32_t dir_index;			/* Next Direct index. */
-    uint32_t indir_index;		/* Next indirect index. */
-    uint32_t double_indir_index;	/* Next double indirect index. */
+    struct rwlock rw;			/* Held for reading while reading or
+					   writing data, for writing while
+					   changing the sector map. */
     block_sector_t parent;		/* Parent inode sector. */
     off_t file_length;			/* File length/size in bytes. */
     off_t read_length;			/* Actual readable length from file. */
     bool is_dir;			/* Specify if inode is for directory. */
-    block_sector_t ptrs[MAX_BLOCK_INODE];
+    bool is_inline;			/* Data is in `data', not extents.
+					   Protected by lock. */
+    uint32_t extent_cnt;		/* Number of extents, in file order. */
+    block_sector_t overflow;		/* First overflow extent block. */
+    union
+      {
+        struct extent extents[INODE_EXTENTS];	/* First extents of file. */
+        uint8_t data[INODE_INLINE_MAX];		/* Or all of its data. */
+      };
+
+    /* The extent byte_to_sector() found last, so that lookups
+       within it need not walk the extent list.  Protected by
+       map_lock. */
+    struct lock map_lock;
+    size_t map_start;			/* First file sector in the run. */
+    block_sector_t map_sector;		/* Its disk sector. */
+    size_t map_cnt;			/* Sectors in the run; 0 if none. */
+
+    /* Data written into holes of a file that has no disk space
+       yet, see buffer_pending().  Protected by lock. */
+    uint8_t *pending;			/* Page of sector images, or null. */
+    size_t pending_start;		/* File sector of the first one. */
+    size_t pending_cnt;			/* Sectors covered so far. */
+    struct list_elem pending_elem;	/* Element in pending_list. */
+
+    /* True if the fields above that go on disk have changed since
+       INODE was last put into its sector in the buffer cache, see
+       write_inode().  Protected by flush_lock. */
+    bool dirty;
+    struct list_elem dirty_elem;	/* Element in dirty_list. */
     /* End of Project 4 */
   };
 
 /* Start of Project 4 */
-void close_double_indirect_inode_block (block_sector_t *, size_t, size_t);
-void close_indirect_inode_block (block_sector_t *, size_t);
 void close_inode (struct inode *);
-size_t expand_indir_for_double_indir_block (struct inode *, size_t, struct indirect_block *);
-size_t expand_double_indirect_block (struct inode *, size_t);
-size_t expand_indirect_block (struct inode *, size_t);
 off_t expand_inode (struct inode *, off_t, bool);
-size_t bytes_to_double_indirect_sector (off_t);
-size_t bytes_to_indirect_sector (off_t);
-size_t bytes_to_direct_sector (off_t);
 bool alloc_inode (struct inode_disk *);
+static void get_extent (struct inode *, size_t, struct extent *);
+static void put_extent (struct inode *, size_t, const struct extent *);
+static bool append_extent (struct inode *, block_sector_t, size_t);
+static bool push_extent (struct inode *, const struct extent *);
+static bool insert_extent (struct inode *, size_t, const struct extent *);
+static void trim_extents (struct inode *);
+static void write_new_run (block_sector_t, size_t, off_t, off_t,
+                           const uint8_t *, bool);
+static size_t fill_hole (struct inode *, off_t, off_t, const void *,
+                         block_sector_t *);
+static bool buffer_pending (struct inode *, const void *, off_t, int);
+static bool flush_pending (struct inode *);
+static void drop_pending (struct inode *);
+static void read_hole (struct inode *, void *, off_t, int);
+static bool spill_inline (struct inode *);
+static void mark_dirty (struct inode *);
+static bool clean_inode (struct inode *);
+static void write_inode (struct inode *);
+static size_t pin_inodes (struct list *, bool, struct inode ***);
+static block_sector_t overflow_block (struct inode *, size_t);
+static block_sector_t sector_run (struct inode *, off_t, off_t, off_t,
+                                  block_sector_t);
+static void zero_data_run (block_sector_t, size_t);
 /* End of Project 4 */
 
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, or 0 if POS lies in a hole that has no sector yet. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t length, off_t pos) 
+byte_to_sector (struct inode *inode, off_t length, off_t pos) 
 {
   ASSERT (inode != NULL);
 
-  uint32_t index, direct_block_idx, indirect_idx, indirect_ptrs[INDIRECT_BLOCK_PTRS];
-
   /* Start of Project 4 */
-  if (length > pos)
+  struct extent_block block;
+  size_t file_sector, ext_start, i;
+  block_sector_t sector;
+
+  if (pos >= length)
+    return -1;
+  file_sector = pos / BLOCK_SECTOR_SIZE;
+
+  lock_acquire (&inode->map_lock);
+  if (file_sector >= inode->map_start
+      && file_sector - inode->map_start < inode->map_cnt)
   {
-    if (pos < BLOCK_SECTOR_SIZE * NUMBER_OF_DIRECT_BLOCKS)
-    {
-      /* Direct Block is used. */
-      direct_block_idx = pos / BLOCK_SECTOR_SIZE;
-      return inode->ptrs[direct_block_idx];
-    }
-    else if (pos < BLOCK_SECTOR_SIZE * ( NUMBER_OF_DIRECT_BLOCKS
-    				       + NUMBER_OF_INDIRECT_BLOCKS * INDIRECT_BLOCK_PTRS))
+    sector = inode->map_sector;
+    if (sector != 0)
+      sector += file_sector - inode->map_start;
+    lock_release (&inode->map_lock);
+    return sector;
+  }
+  lock_release (&inode->map_lock);
+
+  /* Walk the extents, reading overflow blocks one after another as
+     the walk reaches them. */
+  ext_start = 0;
+  for (i = 0; i < inode->extent_cnt; i++)
+  {
+    const struct extent *x;
+
+    if (i < INODE_EXTENTS)
+      x = &inode->extents[i];
+    else
     {
-      /* Indirect Block is used. */
-      pos = pos - (BLOCK_SECTOR_SIZE * NUMBER_OF_DIRECT_BLOCKS);
-      indirect_idx = pos / (BLOCK_SECTOR_SIZE * INDIRECT_BLOCK_PTRS) + NUMBER_OF_DIRECT_BLOCKS;
-
-      /* Read Indirect block from file disk. */
-      block_read (fs_device, inode->ptrs[indirect_idx], &indirect_ptrs);
-      pos = pos % (BLOCK_SECTOR_SIZE * INDIRECT_BLOCK_PTRS);
-      index = pos / BLOCK_SECTOR_SIZE;
-      return indirect_ptrs[index];
+      size_t j = (i - INODE_EXTENTS) % EXTENT_BLOCK_EXTENTS;
+      if (j == 0)
+        cache_read (i == INODE_EXTENTS ? inode->overflow : block.next,
+                    &block, 0, BLOCK_SECTOR_SIZE, true);
+      x = &block.extents[j];
     }
-    else
+
+    if (file_sector - ext_start < x->length)
     {
-      /* Double Indirect Block is used. */
-      /* Read double indirect block from disk. */
-      block_read (fs_device, inode->ptrs[DOUBLE_INDIRECT_BLOCK_INDEX], &indirect_ptrs);
-      pos = pos - (BLOCK_SECTOR_SIZE *  ( NUMBER_OF_DIRECT_BLOCKS
-      					+ NUMBER_OF_INDIRECT_BLOCKS * INDIRECT_BLOCK_PTRS));
-      indirect_idx = pos / (BLOCK_SECTOR_SIZE * INDIRECT_BLOCK_PTRS);
-      /* Read indirect block from disk. */
-      block_read(fs_device, indirect_ptrs[indirect_idx], &indirect_ptrs);
-      pos %= BLOCK_SECTOR_SIZE * INDIRECT_BLOCK_PTRS;
-      index = pos / BLOCK_SECTOR_SIZE;
-      return indirect_ptrs[index];
+      sector = x->start != 0 ? x->start + (file_sector - ext_start) : 0;
+
+      lock_acquire (&inode->map_lock);
+      inode->map_start = ext_start;
+      inode->map_sector = x->start;
+      inode->map_cnt = x->length;
+      lock_release (&inode->map_lock);
+      break;
     }
+    ext_start += x->length;
   }
-  else
-    return -1;
+  ASSERT (i < inode->extent_cnt);
+
+  return sector;
   /* End of Project 4 */
   /***
   if (pos < inode->data.length)
@@ -135,15 +238,46 @@ byte_to_sector (const struct inode *inode, off_t length, off_t pos)
   ***/
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Start of Project 4 */
+/* Table of open inodes, hashed by sector, so that opening a single
+   inode twice returns the same `struct inode'.  open_inodes_lock
+   protects the table and every open inode's open_cnt and busy.
+   A newly opened inode is read from disk, and a closing one written
+   back, with the lock released but the inode in the table marked
+   busy; openers of a busy inode wait on open_inodes_cond, so that
+   none can see a stale copy. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+static struct condition open_inodes_cond;
+
+/* Files with pending data, and inodes that are dirty, oldest
+   first.  flush_lock protects both lists; it is never held while
+   acquiring another lock. */
+static struct list pending_list;
+static struct list dirty_list;
+static struct lock flush_lock;
+
+static unsigned inode_hash_func (const struct hash_elem *, void *);
+static bool inode_less_func (const struct hash_elem *,
+                             const struct hash_elem *, void *);
+/* End of Project 4 */
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  /* Start of Project 4 */
+  //list_init (&open_inodes);
+  ASSERT (offsetof (struct inode, elem) == offsetof (struct inode_key, elem));
+  ASSERT (offsetof (struct inode, sector)
+          == offsetof (struct inode_key, sector));
+  hash_init (&open_inodes, inode_hash_func, inode_less_func, NULL);
+  lock_init (&open_inodes_lock);
+  cond_init (&open_inodes_cond);
+  list_init (&pending_list);
+  list_init (&dirty_list);
+  lock_init (&flush_lock);
+  /* End of Project 4 */
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -167,17 +301,15 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   if (disk_inode != NULL)
     {
       /* Start of Project 4 */
-      if (length > MAX_FILE_SIZE)
-        disk_inode->length = MAX_FILE_SIZE;
-      else
-        disk_inode->length = length;
+      disk_inode->length = length;
       disk_inode->parent = ROOT_DIR_SECTOR;
       disk_inode->is_dir = is_dir;
       disk_inode->magic = INODE_MAGIC;
+      disk_inode->is_inline = length <= INODE_INLINE_MAX;
 
-      if (alloc_inode (disk_inode))
+      if (disk_inode->is_inline || alloc_inode (disk_inode))
       {
-        block_write (fs_device, sector, disk_inode);
+        cache_write (sector, disk_inode, 0, BLOCK_SECTOR_SIZE, true);
 	success = true;
       }
       free (disk_inode);
@@ -211,46 +343,73 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
-  struct inode_disk disk_inode;			/* Project 4 */
-
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Start of Project 4 */
+  struct inode_disk *disk_inode;
+  struct inode_key key;
+  struct hash_elem *e;
+
+  /* Check whether this inode is already open, waiting out anyone
+     reading it in or writing it back. */
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  while ((e = hash_find (&open_inodes, &key.elem)) != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      inode = hash_entry (e, struct inode, elem);
+      if (!inode->busy)
         {
-          inode_reopen (inode);
-          return inode; 
+          inode->open_cnt++;
+          lock_release (&open_inodes_lock);
+          return inode;
         }
+      cond_wait (&open_inodes_cond, &open_inodes_lock);
     }
+  /* End of Project 4 */
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
-  if (inode == NULL)
-    return NULL;
+  disk_inode = malloc (sizeof *disk_inode);		/* Project 4 */
+  if (inode == NULL || disk_inode == NULL)		/* Project 4 */
+    {
+      lock_release (&open_inodes_lock);			/* Project 4 */
+      free (inode);					/* Project 4 */
+      free (disk_inode);				/* Project 4 */
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
 
   /* Start of Project 4 */
+  inode->busy = true;
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
   //block_read (fs_device, inode->sector, &inode->data);
   lock_init(&inode->lock);
-  block_read(fs_device, inode->sector, &disk_inode);
-  inode->read_length = disk_inode.length;
-  inode->file_length = disk_inode.length;
-  inode->is_dir = disk_inode.is_dir;
-  inode->parent = disk_inode.parent;
-  inode->dir_index = disk_inode.dir_index;
-  inode->indir_index = disk_inode.indir_index;
-  inode->double_indir_index = disk_inode.double_indir_index;
-  memcpy(&inode->ptrs, &disk_inode.ptrs, MAX_BLOCK_INODE * sizeof(block_sector_t));
+  rwlock_init (&inode->rw);
+  lock_init (&inode->map_lock);
+  inode->map_cnt = 0;
+  inode->pending = NULL;
+  inode->dirty = false;
+  cache_read (inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE, true);
+  inode->read_length = disk_inode->length;
+  inode->file_length = disk_inode->length;
+  inode->is_dir = disk_inode->is_dir;
+  inode->is_inline = disk_inode->is_inline;
+  inode->parent = disk_inode->parent;
+  inode->extent_cnt = disk_inode->extent_cnt;
+  inode->overflow = disk_inode->overflow;
+  memcpy (inode->extents, disk_inode->extents, sizeof inode->extents);
+  free (disk_inode);
+
+  lock_acquire (&open_inodes_lock);
+  inode->busy = false;
+  cond_broadcast (&open_inodes_cond, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
   /* End of Project 4 */
 
   return inode;
@@ -261,7 +420,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);			/* Project 4 */
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);			/* Project 4 */
+    }
   return inode;
 }
 
@@ -283,10 +446,26 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
+  lock_acquire (&open_inodes_lock);				/* Project 4 */
   if (--inode->open_cnt == 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      /* Start of Project 4 */
+      /* Keep INODE in the table, busy, until it is written back,
+         so that openers wait for it instead of reading a stale
+         copy from disk. */
+      inode->busy = true;
+      lock_release (&open_inodes_lock);
+
+      /* Give pending data its sectors before the extents are
+         written back, or drop it if the file is going away.  No
+         one else can have INODE now, as inode_flush() holds a
+         reference to any inode it works on. */
+      if (!inode->removed)
+        flush_pending (inode);
+      drop_pending (inode);
+      if (clean_inode (inode) && !inode->removed)
+        write_inode (inode);
+      /* End of Project 4 */
  
       /* Deallocate blocks if removed. */
       if (inode->removed) 
@@ -298,23 +477,16 @@ inode_close (struct inode *inode)
 	  close_inode (inode);
 	  /* End of Project 4 */
         }
-      else
-        {
-	  struct inode_disk data;
-	  data.length = inode->file_length;
-	  data.parent = inode->parent;
-	  data.is_dir = inode->is_dir;
-	  data.dir_index = inode->dir_index;
-	  data.indir_index = inode->indir_index;
-	  data.double_indir_index = inode->double_indir_index;
-	  data.magic = INODE_MAGIC;
-
-	  memcpy (&data.ptrs, &(inode->ptrs), MAX_BLOCK_INODE * sizeof(block_sector_t));
-	  block_write (fs_device, inode->sector, &data);
-	}
 
+      /* Remove from inode list. */
+      lock_acquire (&open_inodes_lock);				/* Project 4 */
+      hash_delete (&open_inodes, &inode->elem);		/* Project 4 */
+      cond_broadcast (&open_inodes_cond, &open_inodes_lock);	/* Project 4 */
+      lock_release (&open_inodes_lock);				/* Project 4 */
       free (inode); 
     }
+  else
+    lock_release (&open_inodes_lock);				/* Project 4 */
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -337,8 +509,27 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 
   /* Start of Project 4 */
   off_t read_length = inode->read_length;
+  bool direct = size >= INODE_DIRECT_MIN;
   if (read_length <= offset)
     return bytes_read;
+
+  /* Small files are read straight out of the inode. */
+  if (inode->is_inline)
+    {
+      if (!inode->is_dir)
+        lock_acquire (&inode->lock);
+      if (inode->is_inline)
+        {
+          bytes_read = size < read_length - offset ? size : read_length - offset;
+          memcpy (buffer, inode->data + offset, bytes_read);
+        }
+      if (!inode->is_dir)
+        lock_release (&inode->lock);
+      if (bytes_read > 0)
+        return bytes_read;
+    }
+
+  rwlock_acquire_read (&inode->rw);
   /* End of Project 4 */
 
   while (size > 0) 
@@ -381,11 +572,18 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       ***/
 
       /***/
-      struct cached_block *cb = get_cached_block (sector_idx ,false);
-      cb->open--;
-      cb->accessed = true;
-
-      memcpy (buffer + bytes_read, (uint8_t *)&cb->data + sector_ofs, chunk_size);
+      if (sector_idx == 0)
+        read_hole (inode, buffer + bytes_read, offset, chunk_size);
+      else if (direct && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          block_sector_t cnt = sector_run (inode, read_length, offset, size,
+                                           sector_idx);
+          cache_read_direct (sector_idx, cnt, buffer + bytes_read);
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+        }
+      else
+        cache_read (sector_idx, buffer + bytes_read, sector_ofs, chunk_size,
+                    inode->is_dir);
       /***/
 
       /* End of Project 4 */
@@ -395,6 +593,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+  rwlock_release_read (&inode->rw);			/* Project 4 */
   //free (bounce); 			/* Project 4 */
 
   return bytes_read;
@@ -411,18 +610,61 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
+  bool direct = size >= INODE_DIRECT_MIN;		/* Project 4 */
+  bool buffered;					/* Project 4 */
+  size_t filled;					/* Project 4 */
 
   if (inode->deny_write_cnt)
     return 0;
 
+  /* Start of Project 4 */
+  /* Small files are written straight into the inode, and moved out
+     to a data sector once they outgrow it. */
+  if (inode->is_inline)
+    {
+      rwlock_acquire_write (&inode->rw);
+      if (!inode->is_dir)
+        lock_acquire (&inode->lock);
+      if (inode->is_inline && offset + size <= INODE_INLINE_MAX)
+        {
+          memcpy (inode->data + offset, buffer, size);
+          if (offset + size > inode->file_length)
+            inode->file_length = offset + size;
+          inode->read_length = inode->file_length;
+          mark_dirty (inode);
+          bytes_written = size;
+        }
+      else if (inode->is_inline && !spill_inline (inode))
+        size = 0;
+      if (!inode->is_dir)
+        lock_release (&inode->lock);
+      rwlock_release_write (&inode->rw);
+      if (bytes_written > 0 || size == 0)
+        return bytes_written;
+    }
+  /* End of Project 4 */
+
+  /* Start of Project 4 */
+  /* Writers hold INODE's rwlock for reading, so they go alongside
+     readers and each other, and take it for writing only to change
+     the length or the sector map.  Another writer may have grown
+     the file meanwhile. */
   if (offset + size > inode_length (inode))
   {
+    rwlock_acquire_write (&inode->rw);
     if (!inode->is_dir)
       lock_acquire (&(inode->lock));
-    inode->file_length = expand_inode (inode, offset + size, false);
+    if (offset + size > inode->file_length)
+    {
+      inode->file_length = expand_inode (inode, offset + size, false);
+      mark_dirty (inode);
+    }
     if (!inode->is_dir)
       lock_release (&(inode->lock));
+    rwlock_release_write (&inode->rw);
   }
+  rwlock_acquire_read (&inode->rw);
+  /* End of Project 4 */
 
   while (size > 0) 
     {
@@ -441,6 +683,53 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
         break;
 
       /* Start of Project 4 */
+      /* Give a hole its disk space on first write, writing the data
+         into it as it goes.  Small writes to a file's holes wait in
+         its pending page instead, so that many appends get one run
+         of sectors together. */
+      buffered = false;
+      filled = 0;
+      if (sector_idx == 0)
+        {
+          rwlock_release_read (&inode->rw);
+          rwlock_acquire_write (&inode->rw);
+          if (!inode->is_dir)
+            lock_acquire (&inode->lock);
+          sector_idx = byte_to_sector (inode, inode_length (inode), offset);
+          if (sector_idx != 0)
+            {
+              /* Filled by another writer meanwhile. */
+            }
+          else if (!inode->is_dir && !direct
+              && buffer_pending (inode, buffer + bytes_written, offset,
+                                 chunk_size))
+            buffered = true;
+          else if (inode->is_dir || flush_pending (inode))
+            {
+              off_t n = size < inode_left ? size : inode_left;
+
+              /* The pending page may have held this sector. */
+              sector_idx = byte_to_sector (inode, inode_length (inode),
+                                           offset);
+              if (sector_idx == 0)
+                filled = fill_hole (inode, offset, n,
+                                    buffer + bytes_written, &sector_idx);
+              if (filled > 0)
+                {
+                  chunk_size = (offset / BLOCK_SECTOR_SIZE + filled)
+                               * BLOCK_SECTOR_SIZE - offset;
+                  if (chunk_size > n)
+                    chunk_size = n;
+                }
+            }
+          if (!inode->is_dir)
+            lock_release (&inode->lock);
+          rwlock_release_write (&inode->rw);
+          rwlock_acquire_read (&inode->rw);
+          if (!buffered && sector_idx == 0)
+            break;
+        }
+
       /***
       if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
@@ -470,12 +759,20 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       ***/
 
       /***/
-      struct cached_block *cb = get_cached_block (sector_idx, true);
-      cb->open--;
-      cb->accessed = true;
-      cb->dirty = true;
-
-      memcpy ((uint8_t *)&cb->data + sector_ofs, buffer + bytes_written, chunk_size);
+      if (buffered || filled > 0)
+        {
+          /* Held in the pending page, or written by fill_hole(). */
+        }
+      else if (direct && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          block_sector_t cnt = sector_run (inode, inode_length (inode),
+                                           offset, size, sector_idx);
+          cache_write_direct (sector_idx, cnt, buffer + bytes_written);
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+        }
+      else
+        cache_write (sector_idx, buffer + bytes_written, sector_ofs,
+                     chunk_size, inode->is_dir);
       /***/
 
       /* End of Project 4 */
@@ -486,6 +783,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
   inode->read_length = inode->file_length;
+  rwlock_release_read (&inode->rw);			/* Project 4 */
   //free (bounce); 			/* Project 4 */
 
   return bytes_written;
@@ -522,24 +820,37 @@ inode_length (const struct inode *inode)
 
 /* Start of Project 4 */
 
+/* Allocates and zeros the data sectors for DISK_INODE's length,
+   recording them in its extents.  Returns true if successful,
+   false if the disk was too full or memory ran out, in which case
+   nothing is left allocated.
+
+   The work is done on a zeroed scratch inode that is never opened.
+   expand_inode() and close_inode() use only its file_length,
+   extent_cnt, overflow and extents, none of its locks. */
 bool
 alloc_inode (struct inode_disk *disk_inode)
 {
-  struct inode inode;
+  struct inode *inode = calloc (1, sizeof *inode);
+  bool success;
 
-  inode.file_length = 0;
-  inode.dir_index = 0;
-  inode.indir_index = 0;
-  inode.double_indir_index = 0;
-
-  expand_inode (&inode, disk_inode->length, true);
+  if (inode == NULL)
+    return false;
 
-  disk_inode->dir_index = inode.dir_index;
-  disk_inode->indir_index = inode.indir_index;
-  disk_inode->double_indir_index = inode.double_indir_index;
-  memcpy(&disk_inode->ptrs, &inode.ptrs, MAX_BLOCK_INODE * sizeof(block_sector_t));
+  success = expand_inode (inode, disk_inode->length, true)
+            == disk_inode->length;
+  if (success)
+  {
+    disk_inode->extent_cnt = inode->extent_cnt;
+    disk_inode->overflow = inode->overflow;
+    memcpy (disk_inode->extents, inode->extents,
+            sizeof disk_inode->extents);
+  }
+  else
+    close_inode (inode);
 
-  return true;
+  free (inode);
+  return success;
 }
 
 bool
@@ -548,272 +859,785 @@ inode_is_dir (struct inode *inode)
   return inode->is_dir;
 }
 
-size_t
-bytes_to_direct_sector (off_t size)
+/* Grows INODE to cover LENGTH bytes.  Unless CREATE_INODE, the new
+   sectors are left as a hole that reads as zeros and gets disk
+   space only when written, see fill_hole().  If CREATE_INODE, they
+   are allocated and zeroed now, and the call fails up front unless
+   the disk has room for all of them; each step takes the longest
+   run of free sectors it can, preferring the ones right after the
+   file's last sector so that its last extent just gets longer.
+   Returns the length covered, which falls short of LENGTH if the
+   disk filled up, but is never less than INODE's current length
+   nor rounded up past it to the end of a sector that nothing was
+   added to. */
+off_t
+expand_inode (struct inode *inode, off_t length, bool create_inode)
 {
-  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+  size_t have = bytes_to_sectors (inode->file_length);
+  size_t want = bytes_to_sectors (length);
+  off_t covered;
+
+  if (want <= have)
+    return length;
+
+  if (!create_inode)
+    return append_extent (inode, 0, want - have)
+           ? length : inode->file_length;
+
+  if (free_map_count () < want - have)
+    return inode->file_length;
+
+  while (have < want)
+  {
+    block_sector_t hint = 0, start;
+    size_t cnt;
+
+    if (inode->extent_cnt > 0)
+    {
+      struct extent last;
+      get_extent (inode, inode->extent_cnt - 1, &last);
+      hint = last.start + last.length;
+    }
+
+    cnt = free_map_allocate_run (want - have, hint, &start);
+    if (cnt == 0)
+      break;
+    if (!append_extent (inode, start, cnt))
+    {
+      free_map_release (start, cnt);
+      break;
+    }
+    zero_data_run (start, cnt);
+    have += cnt;
+  }
+
+  if (have == want)
+    return length;
+  covered = (off_t) have * BLOCK_SECTOR_SIZE;
+  if (covered > length)
+    covered = length;
+  if (covered < inode->file_length)
+    covered = inode->file_length;
+  return covered;
 }
 
-size_t
-bytes_to_indirect_sector (off_t size)
+/* Stores extent IDX of INODE into *X. */
+static void
+get_extent (struct inode *inode, size_t idx, struct extent *x)
 {
-  if (size <= BLOCK_SECTOR_SIZE * NUMBER_OF_DIRECT_BLOCKS)
-    return 0;
-  size -= BLOCK_SECTOR_SIZE * NUMBER_OF_DIRECT_BLOCKS;
-  return DIV_ROUND_UP(size, BLOCK_SECTOR_SIZE * INDIRECT_BLOCK_PTRS);
+  ASSERT (idx < inode->extent_cnt);
+
+  if (idx < INODE_EXTENTS)
+    *x = inode->extents[idx];
+  else
+  {
+    size_t j = (idx - INODE_EXTENTS) % EXTENT_BLOCK_EXTENTS;
+    cache_read (overflow_block (inode, idx), x,
+                offsetof (struct extent_block, extents[j]), sizeof *x, true);
+  }
 }
 
-size_t
-bytes_to_double_indirect_sector (off_t size)
+/* Stores *X as extent IDX of INODE, which must already exist or
+   be the next one, with its overflow block already chained. */
+static void
+put_extent (struct inode *inode, size_t idx, const struct extent *x)
 {
-  if (size <= BLOCK_SECTOR_SIZE * ( NUMBER_OF_DIRECT_BLOCKS
-				  + NUMBER_OF_INDIRECT_BLOCKS * INDIRECT_BLOCK_PTRS))
-    return 0;
+  ASSERT (idx <= inode->extent_cnt);
 
-  return NUMBER_OF_DOUBLE_IBLOCKS;
+  if (idx < INODE_EXTENTS)
+    inode->extents[idx] = *x;
+  else
+  {
+    size_t j = (idx - INODE_EXTENTS) % EXTENT_BLOCK_EXTENTS;
+    cache_write (overflow_block (inode, idx), x,
+                 offsetof (struct extent_block, extents[j]), sizeof *x, true);
+  }
 }
 
-off_t
-expand_inode (struct inode *inode, off_t length, bool create_inode)
+/* Adds the CNT sectors starting at START to the end of INODE's
+   allocation, or a hole of CNT sectors if START is 0, by
+   lengthening its last extent if they follow it on disk (or both
+   are holes) or else by adding an extent, in a new overflow block
+   if need be.  Returns true if successful, false if an overflow
+   block was needed and could not be allocated. */
+static bool
+append_extent (struct inode *inode, block_sector_t start, size_t cnt)
 {
-  static char zero_sector[BLOCK_SECTOR_SIZE];
-  size_t new_sectors = bytes_to_sectors (length) - bytes_to_sectors (inode->file_length);
-
-  if (new_sectors == 0)
-    return length;
+  struct extent x;
+  size_t idx = inode->extent_cnt;
 
-  if (create_inode)
+  if (idx > 0)
   {
-    if (free_map_count () < new_sectors)
-      return 0;
+    get_extent (inode, idx - 1, &x);
+    if (start != 0 ? x.start != 0 && x.start + x.length == start
+                   : x.start == 0)
+    {
+      x.length += cnt;
+      put_extent (inode, idx - 1, &x);
+      return true;
+    }
   }
 
-  /* Allocate direct sectors of inode */
-  while (inode->dir_index < INDIRECT_BLOCK_INDEX)
+  x.start = start;
+  x.length = cnt;
+  return push_extent (inode, &x);
+}
+
+/* Adds *X as a new last extent of INODE, chaining a new overflow
+   block if need be.  Returns true if successful, false if an
+   overflow block was needed and could not be allocated. */
+static bool
+push_extent (struct inode *inode, const struct extent *x)
+{
+  size_t idx = inode->extent_cnt;
+
+  if (idx >= INODE_EXTENTS
+      && (idx - INODE_EXTENTS) % EXTENT_BLOCK_EXTENTS == 0)
   {
-    uint32_t inode_idx = inode->dir_index;
+    /* The last overflow block, if any, is full.  Chain a new one. */
+    block_sector_t block;
 
-    if (!free_map_allocate (1, &inode->ptrs[inode_idx]))
-      return 0;
+    if (!free_map_allocate (1, &block))
+      return false;
+    if (idx == INODE_EXTENTS)
+      inode->overflow = block;
+    else
+      cache_write (overflow_block (inode, idx - 1), &block,
+                   offsetof (struct extent_block, next), sizeof block, true);
+  }
 
-    block_write(fs_device, inode->ptrs[inode_idx], zero_sector);
-    new_sectors--;
-    inode->dir_index++;
+  put_extent (inode, idx, x);
+  inode->extent_cnt++;
+  return true;
+}
 
-    if (new_sectors == 0)
-      return length;
+/* Inserts *X as extent IDX of INODE, moving the extents from IDX
+   on up by one.  Returns true if successful, false if an overflow
+   block was needed and could not be allocated. */
+static bool
+insert_extent (struct inode *inode, size_t idx, const struct extent *x)
+{
+  struct extent y;
+  size_t i;
+
+  ASSERT (idx <= inode->extent_cnt);
+
+  if (idx == inode->extent_cnt)
+    return push_extent (inode, x);
+
+  get_extent (inode, inode->extent_cnt - 1, &y);
+  if (!push_extent (inode, &y))
+    return false;
+  for (i = inode->extent_cnt - 2; i > idx; i--)
+  {
+    get_extent (inode, i - 1, &y);
+    put_extent (inode, i, &y);
   }
+  put_extent (inode, idx, x);
+  return true;
+}
 
-  /* Allocate indirect sectors of inode */
-  while (inode->dir_index < DOUBLE_INDIRECT_BLOCK_INDEX)
+/* Drops empty holes from the end of INODE's extents, releasing any
+   overflow block that no longer holds an extent. */
+static void
+trim_extents (struct inode *inode)
+{
+  while (inode->extent_cnt > 0)
   {
-    new_sectors = expand_indirect_block (inode, new_sectors);
+    size_t idx = inode->extent_cnt - 1;
+    struct extent x;
 
-    if (new_sectors == 0)
-      return length;
+    get_extent (inode, idx, &x);
+    if (x.start != 0 || x.length != 0)
+      break;
+    if (idx >= INODE_EXTENTS
+        && (idx - INODE_EXTENTS) % EXTENT_BLOCK_EXTENTS == 0)
+    {
+      free_map_release (overflow_block (inode, idx), 1);
+      if (idx == INODE_EXTENTS)
+        inode->overflow = 0;
+    }
+    inode->extent_cnt--;
   }
+}
 
-  /* Allocate double indirect sectors of inode */
-  if (inode->dir_index == DOUBLE_INDIRECT_BLOCK_INDEX)
+/* Allocates disk space for the hole in INODE that byte OFFSET
+   falls in, from OFFSET's sector on through as much of the SIZE
+   bytes written there as one run of free sectors and the hole
+   reach.  The run is taken right after the data before the hole
+   if possible, so that extent just gets longer.  The new sectors
+   are written before they are added to the map, each once: from
+   DATA, which holds the SIZE bytes that go at OFFSET, with zeros
+   around it in the first and last sector, or with zeros alone if
+   DATA is null.  Stores the disk
+   sector for OFFSET in *SECTORP and returns the number of sectors
+   allocated, or returns 0 if the disk is full.  If OFFSET already
+   has a sector, just stores it and returns 1.  The caller must
+   keep other writers out. */
+static size_t
+fill_hole (struct inode *inode, off_t offset, off_t size, const void *data,
+           block_sector_t *sectorp)
+{
+  static const struct extent empty;
+  size_t file_sector = offset / BLOCK_SECTOR_SIZE;
+  size_t end_sector = (offset + size - 1) / BLOCK_SECTOR_SIZE;
+  size_t ext_start = 0, idx, left, right, got, last, n, k;
+  struct extent hole, prev, pieces[3];
+  block_sector_t hint = 0, start;
+  bool merge;
+
+  for (idx = 0; idx < inode->extent_cnt; idx++)
   {
-    new_sectors = expand_double_indirect_block (inode, new_sectors);
+    get_extent (inode, idx, &hole);
+    if (file_sector - ext_start < hole.length)
+      break;
+    ext_start += hole.length;
   }
+  ASSERT (idx < inode->extent_cnt);
 
-  return (length - new_sectors*BLOCK_SECTOR_SIZE);
+  /* Another writer may have filled it already. */
+  if (hole.start != 0)
+  {
+    *sectorp = hole.start + (file_sector - ext_start);
+    return 1;
+  }
 
-}
+  left = file_sector - ext_start;
+  last = ext_start + hole.length - 1;
+  if (last > end_sector)
+    last = end_sector;
+  if (left == 0 && idx > 0)
+  {
+    get_extent (inode, idx - 1, &prev);
+    if (prev.start != 0)
+      hint = prev.start + prev.length;
+  }
 
-size_t
-expand_indirect_block (struct inode *inode, size_t new_sectors)
-{
-  static char zero_sector[BLOCK_SECTOR_SIZE];
-  struct indirect_block new_block;
+  got = free_map_allocate_run (last - file_sector + 1, hint, &start);
+  if (got == 0)
+    return 0;
+  right = hole.length - left - got;
+  merge = hint != 0 && start == hint;
 
-  /* Check if new sectors needs to be allocated for indirect block.
-   * Else read previous indirect block from disk and continue. */
-  if (inode->indir_index == 0)
-    free_map_allocate (1, &inode->ptrs[inode->dir_index]);
+  /* Fill the new sectors before the map points to them, so that a
+     reader never sees their old contents. */
+  if (data != NULL)
+    write_new_run (start, got, offset, size, data, inode->is_dir);
   else
-    block_read(fs_device, inode->ptrs[inode->dir_index], &new_block);
+    zero_data_run (start, got);
+
+  /* Split the hole into what is left of it before and after the
+     new run. */
+  n = 0;
+  if (left > 0)
+    pieces[n++] = (struct extent) {0, left};
+  if (!merge)
+    pieces[n++] = (struct extent) {start, got};
+  if (right > 0)
+    pieces[n++] = (struct extent) {0, right};
+
+  /* Make room first.  Empty holes do not change the map, so it is
+     still valid if an overflow block cannot be had. */
+  for (k = 1; k < n; k++)
+    if (!insert_extent (inode, idx, &empty))
+    {
+      free_map_release (start, got);
+      return 0;
+    }
 
-  /* Allocate direct blocks from indirect block retrieved from above if.
-   * Decrement new_sectors, if all required blocks are allocated then break. */
-  while (inode->indir_index < INDIRECT_BLOCK_PTRS)
+  if (merge)
   {
-    free_map_allocate(1, &new_block.ptrs[inode->indir_index]);
-    block_write(fs_device, new_block.ptrs[inode->indir_index], zero_sector);
-    inode->indir_index++;
-    new_sectors--;
-
-    if (new_sectors == 0)
-      break;
+    prev.length += got;
+    put_extent (inode, idx - 1, &prev);
   }
+  for (k = 0; k < n; k++)
+    put_extent (inode, idx + k, &pieces[k]);
+  if (n == 0)
+    put_extent (inode, idx, &empty);
+  trim_extents (inode);
+
+  lock_acquire (&inode->map_lock);
+  inode->map_cnt = 0;
+  lock_release (&inode->map_lock);
+  mark_dirty (inode);
+
+  *sectorp = start;
+  return got;
+}
 
-  block_write (fs_device, inode->ptrs[inode->dir_index], &new_block);
-  
-  /* Update the direct and indirect block indices in inode. */
-  if (inode->indir_index == INDIRECT_BLOCK_PTRS)
+/* Writes the GOT new sectors from START on, the first of which is
+   to hold byte OFFSET of a file, from the SIZE bytes at DATA that go
+   at OFFSET.  Sectors DATA covers whole are written straight from
+   it; the first and last, if it covers them only in part, are
+   padded with zeros.  METADATA is passed on to the cache. */
+static void
+write_new_run (block_sector_t start, size_t got, off_t offset, off_t size,
+               const uint8_t *data, bool metadata)
+{
+  off_t first = offset - offset % BLOCK_SECTOR_SIZE;
+  off_t end = offset + size;
+  uint8_t *bounce = NULL;
+  size_t i = 0;
+
+  while (i < got)
   {
-    inode->indir_index = 0;
-    inode->dir_index++;
+    off_t pos = first + (off_t) i * BLOCK_SECTOR_SIZE;
+    off_t lo = pos > offset ? pos : offset;
+    off_t hi = pos + BLOCK_SECTOR_SIZE < end ? pos + BLOCK_SECTOR_SIZE : end;
+
+    if (lo == pos && hi == pos + BLOCK_SECTOR_SIZE)
+    {
+      size_t n = (end - pos) / BLOCK_SECTOR_SIZE;
+
+      if (n > got - i)
+        n = got - i;
+      if (n > CACHE_RUN_SECTORS)
+        n = CACHE_RUN_SECTORS;
+      cache_write_direct (start + i, n, data + (pos - offset));
+      i += n;
+      continue;
+    }
+
+    if (bounce == NULL)
+      bounce = malloc (BLOCK_SECTOR_SIZE);
+    if (bounce != NULL)
+    {
+      memset (bounce, 0, BLOCK_SECTOR_SIZE);
+      memcpy (bounce + (lo - pos), data + (lo - offset), hi - lo);
+      cache_write (start + i, bounce, 0, BLOCK_SECTOR_SIZE, metadata);
+    }
+    else
+    {
+      zero_data_run (start + i, 1);
+      cache_write (start + i, data + (lo - offset), lo - pos, hi - lo,
+                   metadata);
+    }
+    i++;
   }
+  free (bounce);
+}
 
+/* Copies the SIZE bytes in BUFFER, which go at OFFSET in INODE
+   within a single hole sector, into INODE's pending page, starting
+   a page there if INODE has none.  A page that does not reach
+   OFFSET's sector is flushed first.  Returns false if no page
+   could be had.  Must be called with INODE's lock held.
+
+   This is delayed allocation: the pending sectors get disk space
+   only when the page is flushed, by the next write elsewhere, by
+   the write-behind thread, or when the file is closed, and then as
+   a single run where the free map allows.  Only PENDING_SECTORS
+   sectors, one page, can wait this way; a run of appends longer
+   than that is allocated one page at a time, and direct writes
+   bypass the page altogether. */
+static bool
+buffer_pending (struct inode *inode, const void *buffer, off_t offset,
+                int size)
+{
+  size_t file_sector = offset / BLOCK_SECTOR_SIZE;
+  size_t idx;
+
+  if (inode->pending != NULL
+      && (file_sector < inode->pending_start
+          || file_sector - inode->pending_start >= PENDING_SECTORS)
+      && !flush_pending (inode))
+    return false;
+
+  if (inode->pending == NULL)
+  {
+    inode->pending = palloc_get_page (PAL_ZERO);
+    if (inode->pending == NULL)
+      return false;
+    inode->pending_start = file_sector;
+    inode->pending_cnt = 0;
+    lock_acquire (&flush_lock);
+    list_push_back (&pending_list, &inode->pending_elem);
+    lock_release (&flush_lock);
+  }
 
-  return new_sectors;
+  idx = file_sector - inode->pending_start;
+  memcpy (inode->pending + idx * BLOCK_SECTOR_SIZE
+          + offset % BLOCK_SECTOR_SIZE, buffer, size);
+  if (idx >= inode->pending_cnt)
+    inode->pending_cnt = idx + 1;
+  return true;
 }
 
-size_t
-expand_double_indirect_block (struct inode *inode, size_t new_sectors)
+/* Gives INODE's pending sectors disk space, in as few runs as the
+   free map allows, and writes them out.  Returns true if
+   successful, false if the disk filled up, in which case the page
+   is kept.  Must be called with INODE's lock held. */
+static bool
+flush_pending (struct inode *inode)
 {
-  struct indirect_block new_block;
+  size_t i = 0;
 
-  /* Check if new sectors needs to be allocated for double indirect block.
-   * Else read previous double indirect block from disk and continue. */
-  if (inode->double_indir_index == 0 && inode->indir_index == 0)
-    free_map_allocate (1, &inode->ptrs[inode->dir_index]);
-  else
-    block_read (fs_device, inode->ptrs[inode->dir_index], &new_block);
+  if (inode->pending == NULL)
+    return true;
 
-  while (inode->indir_index < INDIRECT_BLOCK_PTRS)
+  while (i < inode->pending_cnt)
   {
-    /* Expand the double indirect block to add a new block. */
-    new_sectors = expand_indir_for_double_indir_block (inode, new_sectors, &new_block);
+    off_t ofs = (inode->pending_start + i) * BLOCK_SECTOR_SIZE;
+    block_sector_t sector;
 
-    if (new_sectors == 0)
-      break;
+    /* Sectors that had space all along were written through the
+       cache, not here. */
+    if (byte_to_sector (inode, inode->file_length, ofs) != 0)
+      i++;
+    else
+    {
+      size_t cnt = fill_hole (inode, ofs,
+                              (inode->pending_cnt - i) * BLOCK_SECTOR_SIZE,
+                              inode->pending + i * BLOCK_SECTOR_SIZE,
+                              &sector);
+      if (cnt == 0)
+        return false;
+      i += cnt;
+    }
   }
 
-  block_write (fs_device, inode->ptrs[inode->dir_index], &new_block);
+  drop_pending (inode);
+  return true;
+}
 
-  return new_sectors;
+/* Frees INODE's pending page, if any, without writing it. */
+static void
+drop_pending (struct inode *inode)
+{
+  if (inode->pending == NULL)
+    return;
+
+  lock_acquire (&flush_lock);
+  list_remove (&inode->pending_elem);
+  lock_release (&flush_lock);
+  palloc_free_page (inode->pending);
+  inode->pending = NULL;
 }
 
-size_t
-expand_indir_for_double_indir_block (struct inode *inode, size_t new_sectors,
-				     struct indirect_block *indir_block)
+/* Reads the SIZE bytes at OFFSET in INODE, which lie within a
+   single sector that was a hole when the caller looked, into
+   BUFFER: whatever is pending there, or zeros. */
+static void
+read_hole (struct inode *inode, void *buffer, off_t offset, int size)
 {
-  struct indirect_block direct_block;
-  static char zero_sector[BLOCK_SECTOR_SIZE];
+  size_t file_sector = offset / BLOCK_SECTOR_SIZE;
+  block_sector_t sector;
 
-  /* Check if new sectors needs to be allocated for indirect block.
-   * Else read previous indirect block from disk and continue. */
-  if (inode->double_indir_index == 0)
-    free_map_allocate (1, &indir_block->ptrs[inode->indir_index]);
+  if (inode->is_dir)
+  {
+    memset (buffer, 0, size);
+    return;
+  }
+
+  /* The hole may have been flushed meanwhile. */
+  lock_acquire (&inode->lock);
+  sector = byte_to_sector (inode, inode->file_length, offset);
+  if (sector != 0)
+    cache_read (sector, buffer, offset % BLOCK_SECTOR_SIZE, size, false);
+  else if (inode->pending != NULL
+           && file_sector >= inode->pending_start
+           && file_sector - inode->pending_start < inode->pending_cnt)
+    memcpy (buffer, inode->pending
+                    + (file_sector - inode->pending_start) * BLOCK_SECTOR_SIZE
+                    + offset % BLOCK_SECTOR_SIZE, size);
   else
-    block_read (fs_device, indir_block->ptrs[inode->indir_index], &direct_block);
+    memset (buffer, 0, size);
+  lock_release (&inode->lock);
+}
 
-  /* Allocate direct blocks from indirect block retrieved from above if.
-   * Decrement new_sectors, if all required blocks are allocated then break. */
-  while (inode->double_indir_index < INDIRECT_BLOCK_PTRS)
+/* Moves the data of inline INODE out to a data sector, so that
+   it can grow past INODE_INLINE_MAX bytes.  Returns true if
+   successful, false if the disk is full, in which case INODE is
+   left inline.  Must be called with INODE's lock held. */
+static bool
+spill_inline (struct inode *inode)
+{
+  uint8_t *sector = calloc (1, BLOCK_SECTOR_SIZE);
+  off_t length = inode->file_length;
+  block_sector_t unused;
+  bool success;
+
+  if (sector == NULL)
+    return false;
+  memcpy (sector, inode->data, length);
+
+  /* Start over as a hole of the same length, then fill it. */
+  memset (inode->extents, 0, sizeof inode->extents);
+  inode->extent_cnt = 0;
+  inode->overflow = 0;
+  inode->file_length = 0;
+  inode->is_inline = false;
+  lock_acquire (&inode->map_lock);
+  inode->map_cnt = 0;
+  lock_release (&inode->map_lock);
+
+  success = (length == 0
+             || (expand_inode (inode, length, false) == length
+                 && fill_hole (inode, 0, BLOCK_SECTOR_SIZE, sector,
+                               &unused) != 0));
+  if (success)
+    {
+      inode->file_length = length;
+      mark_dirty (inode);
+    }
+  else
+    {
+      memcpy (inode->data, sector, INODE_INLINE_MAX);
+      inode->extent_cnt = 0;
+      inode->overflow = 0;
+      inode->file_length = length;
+      inode->is_inline = true;
+    }
+  free (sector);
+  return success;
+}
+
+/* Records that INODE's on-disk fields have changed, so that
+   inode_flush() or the last inode_close() writes it back. */
+static void
+mark_dirty (struct inode *inode)
+{
+  lock_acquire (&flush_lock);
+  if (!inode->dirty)
+    {
+      inode->dirty = true;
+      list_push_back (&dirty_list, &inode->dirty_elem);
+    }
+  lock_release (&flush_lock);
+}
+
+/* Marks INODE clean.  Returns true if it was dirty. */
+static bool
+clean_inode (struct inode *inode)
+{
+  bool dirty;
+
+  lock_acquire (&flush_lock);
+  dirty = inode->dirty;
+  if (dirty)
+    {
+      inode->dirty = false;
+      list_remove (&inode->dirty_elem);
+    }
+  lock_release (&flush_lock);
+  return dirty;
+}
+
+/* Puts INODE's on-disk fields into its sector in the buffer cache,
+   from which the write-behind thread takes it to disk.  The caller
+   must have marked it clean first, so that a change made while it
+   is copied marks it dirty again. */
+static void
+write_inode (struct inode *inode)
+{
+  struct inode_disk data;
+
+  memset (&data, 0, sizeof data);
+  data.length = inode->file_length;
+  data.parent = inode->parent;
+  data.is_dir = inode->is_dir;
+  data.is_inline = inode->is_inline;
+  data.extent_cnt = inode->extent_cnt;
+  data.overflow = inode->overflow;
+  data.magic = INODE_MAGIC;
+  memcpy (data.extents, inode->extents, sizeof data.extents);
+  cache_write (inode->sector, &data, 0, BLOCK_SECTOR_SIZE, true);
+}
+
+/* Gives the pending data of every open file its disk space, then
+   puts every dirty inode into the buffer cache.  Called by the
+   buffer cache's write-behind thread and when the file system
+   shuts down. */
+void
+inode_flush (void)
+{
+  struct inode **inodes;
+  size_t cnt, i;
+  bool full = false;
+
+  /* Once the disk fills, the rest of the pending data waits for
+     next time. */
+  cnt = pin_inodes (&pending_list, true, &inodes);
+  for (i = 0; i < cnt; i++)
   {
-    free_map_allocate (1, &direct_block.ptrs[inode->double_indir_index]);
-    block_write(fs_device, direct_block.ptrs[inode->double_indir_index], zero_sector);
+    struct inode *inode = inodes[i];
 
-    inode->double_indir_index++;
-    new_sectors--;
-    if (new_sectors == 0)
-      break;
+    if (!full)
+    {
+      rwlock_acquire_write (&inode->rw);
+      lock_acquire (&inode->lock);
+      full = !flush_pending (inode);
+      lock_release (&inode->lock);
+      rwlock_release_write (&inode->rw);
+    }
+    inode_close (inode);
   }
+  free (inodes);
 
-  block_write (fs_device, indir_block->ptrs[inode->indir_index], &direct_block);
-
-  /* Since double indirect block is not full, increment the indirect block index
-   * and reset the double indirect block index. */
-  if (inode->double_indir_index < INDIRECT_BLOCK_PTRS)
+  /* Dirty inodes are written without their locks, which for a
+     directory is the lock that is held while opening inodes; a
+     change that races with the copy marks the inode dirty again. */
+  cnt = pin_inodes (&dirty_list, false, &inodes);
+  for (i = 0; i < cnt; i++)
   {
-    inode->double_indir_index = 0;
-    inode->indir_index++;
+    if (clean_inode (inodes[i]))
+      write_inode (inodes[i]);
+    inode_close (inodes[i]);
   }
+  free (inodes);
+}
+
+/* Opens another reference to each inode on LIST, which is
+   pending_list if PENDING or else dirty_list, so that inode_flush()
+   can work on them without holding open_inodes_lock.  Stores them
+   in a new array in *INODESP, which the caller must free after
+   closing each one, and returns how many there are.  Inodes that
+   join LIST meanwhile wait for next time. */
+static size_t
+pin_inodes (struct list *list, bool pending, struct inode ***inodesp)
+{
+  struct inode **inodes;
+  struct list_elem *e;
+  size_t cnt = 0;
+
+  lock_acquire (&open_inodes_lock);
+  lock_acquire (&flush_lock);
+  inodes = malloc (list_size (list) * sizeof *inodes);
+  if (inodes != NULL)
+    for (e = list_begin (list); e != list_end (list); e = list_next (e))
+    {
+      struct inode *inode = pending
+                            ? list_entry (e, struct inode, pending_elem)
+                            : list_entry (e, struct inode, dirty_elem);
+
+      /* A closing inode is flushed by its closer. */
+      if (!inode->busy)
+        {
+          inode->open_cnt++;
+          inodes[cnt++] = inode;
+        }
+    }
+  lock_release (&flush_lock);
+  lock_release (&open_inodes_lock);
 
-  return new_sectors;
+  *inodesp = inodes;
+  return cnt;
 }
 
+/* Returns the overflow block that holds extent IDX of INODE,
+   which must be at least INODE_EXTENTS.  The chain must already
+   reach that far. */
+static block_sector_t
+overflow_block (struct inode *inode, size_t idx)
+{
+  block_sector_t block = inode->overflow;
+  size_t hops;
+
+  ASSERT (idx >= INODE_EXTENTS);
+  for (hops = (idx - INODE_EXTENTS) / EXTENT_BLOCK_EXTENTS; hops > 0; hops--)
+    cache_read (block, &block, offsetof (struct extent_block, next),
+                sizeof block, true);
+  return block;
+}
 
+/* Releases every sector of INODE, data and overflow blocks alike. */
 void
 close_inode (struct inode *inode)
 {
-  size_t direct_sectors = bytes_to_sectors (inode->file_length);
-  size_t indirect_sectors = bytes_to_indirect_sector (inode->file_length);
-  size_t double_indirect_sectors = bytes_to_double_indirect_sector (inode->file_length);
-
-  size_t data_blocks = 0;
-  uint32_t index = 0;
+  block_sector_t block = inode->overflow;
+  size_t i;
 
-  /* Free all the direct blocks. */
-  while (direct_sectors != 0 && index < INDIRECT_BLOCK_INDEX)
+  for (i = 0; i < inode->extent_cnt; i++)
   {
-    free_map_release (inode->ptrs[index], 1);
-    index++;
-    direct_sectors--;
+    struct extent x;
+
+    get_extent (inode, i, &x);
+    if (x.start != 0)
+      free_map_release (x.start, x.length);
   }
 
-  /* Free all the indirect blocks. Call close_indirect_inode_block() for
-   * each indirect inode block which will then expand the sector and
-   * free all direct sectors in input indirect block. */
-  while (indirect_sectors != 0 && index < DOUBLE_INDIRECT_BLOCK_INDEX)
+  for (i = INODE_EXTENTS; i < inode->extent_cnt; i += EXTENT_BLOCK_EXTENTS)
   {
-    if (direct_sectors < INDIRECT_BLOCK_PTRS)
-      data_blocks = direct_sectors;
-    else
-      data_blocks = INDIRECT_BLOCK_PTRS;
+    block_sector_t next;
 
-    close_indirect_inode_block (&inode->ptrs[index], data_blocks);
-
-    index++;
-    direct_sectors -= data_blocks;
-    indirect_sectors--;
+    cache_read (block, &next, offsetof (struct extent_block, next),
+                sizeof next, true);
+    free_map_release (block, 1);
+    block = next;
   }
-
-  /* Free all the sectors represented using double indirect block. */
-  if (double_indirect_sectors != 0)
-    close_double_indirect_inode_block (&inode->ptrs[index], indirect_sectors, direct_sectors);
-
 }
 
-void
-close_indirect_inode_block (block_sector_t *indirect_block, size_t data_blocks)
+/* Zeros the CNT newly allocated data sectors starting at SECTOR,
+   with multi-sector writes.  Any stale cached copy of them is
+   overwritten too. */
+static void
+zero_data_run (block_sector_t sector, size_t cnt)
 {
-  struct indirect_block sector;
-  int i = 0;
- 
-  /* Read the indirect block from disk which contains array of direct blocks. */
-  block_read (fs_device, *indirect_block, &sector);
+  static char zeros[CACHE_RUN_SECTORS * BLOCK_SECTOR_SIZE];
 
-  /* Free each direct block in input indirect_block. */
-  while (i < data_blocks)
-    free_map_release (sector.ptrs[i++], 1);
+  while (cnt > 0)
+  {
+    size_t n = cnt < CACHE_RUN_SECTORS ? cnt : CACHE_RUN_SECTORS;
 
-  /* Free the indirect block. */
-  free_map_release (*indirect_block, 1);
+    cache_write_direct (sector, n, zeros);
+    sector += n;
+    cnt -= n;
+  }
 }
 
-void
-close_double_indirect_inode_block (block_sector_t *double_indirect_block,
-				   size_t indirect_block,
-				   size_t data_blocks)
+/* Returns the number of whole sectors, starting with SECTOR at byte
+   OFFSET of INODE, that lie within both SIZE bytes and LENGTH and
+   are consecutive on disk, up to CACHE_RUN_SECTORS.  OFFSET must
+   be sector-aligned. */
+static block_sector_t
+sector_run (struct inode *inode, off_t length, off_t offset,
+            off_t size, block_sector_t sector)
 {
-  struct indirect_block double_indirect_sector;
-  size_t data_per_indirect;
-  int i;
+  block_sector_t cnt = 1;
 
-  /* Read the double indirect block from disk which contains array of indirect blocks. */
-  block_read (fs_device, *double_indirect_block, &double_indirect_sector);
+  ASSERT (offset % BLOCK_SECTOR_SIZE == 0);
 
-  /* Free each indirect block in input double indirect_block. */
-  while (i < indirect_block)
-  {
-    if (data_blocks < INDIRECT_BLOCK_PTRS)
-      data_per_indirect = data_blocks;
-    else
-      data_per_indirect = INDIRECT_BLOCK_PTRS;
+  while (cnt < CACHE_RUN_SECTORS
+         && (off_t) (cnt + 1) * BLOCK_SECTOR_SIZE <= size
+         && offset + (off_t) (cnt + 1) * BLOCK_SECTOR_SIZE <= length
+         && byte_to_sector (inode, length, offset + cnt * BLOCK_SECTOR_SIZE)
+            == sector + cnt)
+    cnt++;
+  return cnt;
+}
 
-    close_indirect_inode_block (&double_indirect_sector.ptrs[i], data_per_indirect);
-    data_blocks -= data_per_indirect;
-    i++;
+/* Queues the sectors of INODE that follow byte offset POS, up to
+   read_ahead_window sectors, for background reading into the
+   cache.  Sectors before RA_END were already queued by an earlier
+   call and are skipped.  Returns the new read-ahead end offset. */
+off_t
+inode_read_ahead (struct inode *inode, off_t pos, off_t ra_end)
+{
+  off_t length = inode->read_length;
+  off_t ofs = ROUND_UP (pos, BLOCK_SECTOR_SIZE);
+  off_t end = ofs + read_ahead_window * BLOCK_SECTOR_SIZE;
+
+  if (ofs < ra_end)
+    ofs = ra_end;
+  if (end > length)
+    end = length;
+
+  /* The sector map must not change under the walk. */
+  rwlock_acquire_read (&inode->rw);
+  if (inode->is_inline)
+  {
+    rwlock_release_read (&inode->rw);
+    return ra_end;
   }
+  for (; ofs < end; ofs += BLOCK_SECTOR_SIZE)
+  {
+    block_sector_t sector = byte_to_sector (inode, length, ofs);
+    if (sector != 0)
+      cache_read_ahead (sector);
+  }
+  rwlock_release_read (&inode->rw);
 
-  /* Free the double indirect block. */
-  free_map_release (*double_indirect_block, 1);
+  return ofs > ra_end ? ofs : ra_end;
 }
 
 void
@@ -850,6 +1674,26 @@ void
 inode_set_parent (block_sector_t parent, struct inode *inode)
 {
   inode->parent = parent;
+  mark_dirty (inode);
+}
+
+/* Hashes an open inode by its sector number. */
+static unsigned
+inode_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode_key *key = hash_entry (e, struct inode_key, elem);
+  return hash_int (key->sector);
+}
+
+/* Orders open inodes by sector number. */
+static bool
+inode_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct inode_key *a = hash_entry (a_, struct inode_key, elem);
+  const struct inode_key *b = hash_entry (b_, struct inode_key, elem);
+
+  return a->sector < b->sector;
 }
 
 /* End of Project 4 */
@@ -5,23 +5,20 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
-#define MAX_FILE_SIZE (8 * 1024 * 1024)
-
 /* Start of Project 4 */
-#define MAX_BLOCK_INODE 15
-#define NUMBER_OF_DIRECT_BLOCKS 12
-#define NUMBER_OF_INDIRECT_BLOCKS 2
-#define NUMBER_OF_DOUBLE_IBLOCKS 1
-#define INDIRECT_BLOCK_PTRS 128
-#define INODE_BLOCK_PTRS 14
-
-#define DIRECT_BLOCK_INDEX 0
-#define INDIRECT_BLOCK_INDEX 12
-#define DOUBLE_INDIRECT_BLOCK_INDEX 14
-
-struct indirect_block
+#define INODE_EXTENTS 60		/* Extents kept in the inode itself. */
+#define EXTENT_BLOCK_EXTENTS 63		/* Extents per overflow block. */
+
+/* Reads and writes of at least this many bytes move their whole,
+   aligned sectors directly between the caller's buffer and the
+   disk instead of through the buffer cache. */
+#define INODE_DIRECT_MIN (16 * BLOCK_SECTOR_SIZE)
+
+/* A run of LENGTH consecutive sectors starting at START. */
+struct extent
   {
-    block_sector_t ptrs[INDIRECT_BLOCK_PTRS];
+    block_sector_t start;
+    uint32_t length;
   };
 /* End of Project 4 */
 
@@ -48,6 +45,8 @@ int inode_get_open_cnt (struct inode *);
 block_sector_t inode_get_sector (struct inode *);
 bool inode_is_dir (struct inode *);
 void inode_set_parent (block_sector_t, struct inode *);
+off_t inode_read_ahead (struct inode *, off_t, off_t);
+void inode_flush (void);
 /* End of Project 4 */
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,19 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache counters for the file system device, as printed at
+   shutdown and returned by the cachestat() system call. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups found in the cache. */
+    unsigned long long misses;          /* Lookups read from disk. */
+    unsigned long long clean_evictions; /* Clean blocks recycled. */
+    unsigned long long dirty_evictions; /* Dirty blocks written to recycle. */
+    unsigned long long flushes;         /* Blocks written by write-behind. */
+    unsigned long long read_aheads;     /* Blocks read ahead. */
+    unsigned long long read_ahead_hits; /* ...and later used. */
+    unsigned long long read_ahead_wasted; /* ...and dropped unused. */
+    unsigned long long direct;          /* Sectors moved around the cache. */
+  };
+
+#endif /* lib/cache-stats.h */
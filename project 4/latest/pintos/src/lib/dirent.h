@@ -0,0 +1,20 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+#include <stdbool.h>
+
+/* A directory entry, as returned by the getdents() system call.
+   IS_DIR and SIZE are filled in only if attributes are asked
+   for; otherwise they are false and 0.  OPEN_FAILED is set if
+   they were asked for but the entry's inode could not be opened,
+   in which case they are also false and 0. */
+struct dirent
+  {
+    char name[14 + 1];                  /* Null-terminated file name. */
+    int inumber;                        /* Inode number. */
+    bool is_dir;                        /* Directory or file? */
+    bool open_failed;                   /* Attributes unavailable? */
+    int size;                           /* File length in bytes. */
+  };
+
+#endif /* lib/dirent.h */
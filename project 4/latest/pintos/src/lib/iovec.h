@@ -0,0 +1,16 @@
+#ifndef __LIB_IOVEC_H
+#define __LIB_IOVEC_H
+
+#include <stddef.h>
+
+/* One buffer of a readv() or writev() system call. */
+struct iovec
+  {
+    void *iov_base;                     /* Start of the buffer. */
+    size_t iov_len;                     /* Its length in bytes. */
+  };
+
+/* Most buffers one readv() or writev() call accepts. */
+#define IOV_MAX 1024
+
+#endif /* lib/iovec.h */
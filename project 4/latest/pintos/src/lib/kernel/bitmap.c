@@ -23,11 +23,26 @@ typedef unsigned long elem_type;
 
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   Start of Project 4: Searches for false bits, which is how
+   free_map_allocate() and palloc_get_multiple() find free space,
+   are sped up by two pieces of redundant state.  `full' is a
+   second, smaller bitmap with one bit per element of `bits', set
+   if every bit in that element is true, so that a search can skip
+   ELEM_BITS full elements at once.  `first_free' is a low-water
+   mark below which every bit is known to be true, so that a search
+   does not rescan the allocated prefix on every call; the functions
+   that change bits move it, searches only read it.  Updating
+   them is not atomic with updating `bits', so callers that need
+   atomic updates must provide their own locking.  End of
+   Project 4. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    elem_type *full;    /* Bit I set if element I is all true. */
+    size_t first_free;  /* Every bit below this is true. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -68,6 +83,104 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Start of Project 4 */
+
+/* Returns a bit mask of the bits of element ELEM_IDX of B's bits
+   that are actually used. */
+static inline elem_type
+used_mask (const struct bitmap *b, size_t elem_idx)
+{
+  return elem_idx == elem_cnt (b->bit_cnt) - 1 ? last_mask (b) : (elem_type) -1;
+}
+
+/* Returns an elem_type whose bits from bit START % ELEM_BITS up to
+   but not including bit END % ELEM_BITS are set, where START and
+   END fall in the same element, or END is at the start of the
+   next one. */
+static inline elem_type
+range_mask (size_t start, size_t end)
+{
+  elem_type high = end % ELEM_BITS ? bit_mask (end) - 1 : (elem_type) -1;
+  return high & ~(bit_mask (start) - 1);
+}
+
+/* Returns the number of bits set in W, adding up 2-, 4- and then
+   8-bit fields in parallel.  (__builtin_popcountl() would compile
+   to a call into libgcc, which the kernel is not linked with.) */
+static inline size_t
+count_bits (elem_type w)
+{
+  const elem_type ones = (elem_type) -1;
+
+  w -= (w >> 1) & (ones / 3);
+  w = (w & (ones / 5)) + ((w >> 2) & (ones / 5));
+  w = (w + (w >> 4)) & (ones / 17);
+  return (w * (ones / 255)) >> (ELEM_BITS - CHAR_BIT);
+}
+
+/* Returns the index of the lowest bit set in W, which must not be
+   zero. */
+static inline size_t
+lowest_bit (elem_type w)
+{
+  return __builtin_ctzl (w);
+}
+
+/* Brings B's summary bit for element ELEM_IDX up to date. */
+static inline void
+update_full (struct bitmap *b, size_t elem_idx)
+{
+  elem_type mask = used_mask (b, elem_idx);
+
+  if ((b->bits[elem_idx] & mask) == mask)
+    b->full[elem_idx / ELEM_BITS] |= bit_mask (elem_idx);
+  else
+    b->full[elem_idx / ELEM_BITS] &= ~bit_mask (elem_idx);
+}
+
+/* Returns the index of the first bit at or after START in B that
+   is set to VALUE, or B's bit count if there is none. */
+static size_t
+find_next (const struct bitmap *b, size_t start, bool value)
+{
+  size_t cnt = elem_cnt (b->bit_cnt);
+  size_t idx = elem_idx (start);
+  elem_type flip = value ? 0 : (elem_type) -1;
+  elem_type w;
+
+  if (start >= b->bit_cnt)
+    return b->bit_cnt;
+
+  /* Bits of the first element below START do not count. */
+  w = (b->bits[idx] ^ flip) & ~(bit_mask (start) - 1);
+  while (w == 0)
+    {
+      if (++idx >= cnt)
+        return b->bit_cnt;
+
+      /* Looking for a false bit, skip whole runs of full
+         elements using the summary. */
+      if (!value)
+        {
+          elem_type summary = b->full[idx / ELEM_BITS] >> (idx % ELEM_BITS);
+          if (summary == (elem_type) -1 >> (idx % ELEM_BITS))
+            {
+              idx = ROUND_UP (idx + 1, ELEM_BITS) - 1;
+              continue;
+            }
+          idx += lowest_bit (~summary);
+          if (idx >= cnt)
+            return b->bit_cnt;
+        }
+      w = b->bits[idx] ^ flip;
+    }
+
+  idx = idx * ELEM_BITS + lowest_bit (w);
+  return idx < b->bit_cnt ? idx : b->bit_cnt;
+}
+
+/* End of Project 4 */
 
 /* Creation and destruction. */
 
@@ -83,11 +196,15 @@ bitmap_create (size_t bit_cnt)
     {
       b->bit_cnt = bit_cnt;
       b->bits = malloc (byte_cnt (bit_cnt));
-      if (b->bits != NULL || bit_cnt == 0)
+      b->full = malloc (byte_cnt (elem_cnt (bit_cnt)));	/* Project 4 */
+      b->first_free = 0;					/* Project 4 */
+      if ((b->bits != NULL && b->full != NULL) || bit_cnt == 0)
         {
           bitmap_set_all (b, false);
           return b;
         }
+      free (b->bits);
+      free (b->full);
       free (b);
     }
   return NULL;
@@ -105,6 +222,8 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->full = b->bits + elem_cnt (bit_cnt);			/* Project 4 */
+  b->first_free = 0;						/* Project 4 */
   bitmap_set_all (b, false);
   return b;
 }
@@ -114,7 +233,8 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 size_t
 bitmap_buf_size (size_t bit_cnt) 
 {
-  return sizeof (struct bitmap) + byte_cnt (bit_cnt);
+  return sizeof (struct bitmap) + byte_cnt (bit_cnt)
+         + byte_cnt (elem_cnt (bit_cnt));			/* Project 4 */
 }
 
 /* Destroys bitmap B, freeing its storage.
@@ -126,6 +246,7 @@ bitmap_destroy (struct bitmap *b)
   if (b != NULL) 
     {
       free (b->bits);
+      free (b->full);						/* Project 4 */
       free (b);
     }
 }
@@ -164,6 +285,12 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+
+  /* Start of Project 4 */
+  update_full (b, idx);
+  if (bit_idx == b->first_free)
+    b->first_free++;
+  /* End of Project 4 */
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -177,6 +304,12 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+
+  /* Start of Project 4 */
+  update_full (b, idx);
+  if (bit_idx < b->first_free)
+    b->first_free = bit_idx;
+  /* End of Project 4 */
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -192,6 +325,12 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+
+  /* Start of Project 4 */
+  update_full (b, idx);
+  if (bit_idx < b->first_free)
+    b->first_free = bit_idx;
+  /* End of Project 4 */
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -218,14 +357,32 @@ bitmap_set_all (struct bitmap *b, bool value)
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  /* Start of Project 4 */
+  size_t end = start + cnt;
   size_t i;
-  
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  /* Set a word at a time. */
+  for (i = start; i < end; i = ROUND_UP (i + 1, ELEM_BITS))
+    {
+      size_t idx = elem_idx (i);
+      size_t limit = (idx + 1) * ELEM_BITS < end ? (idx + 1) * ELEM_BITS : end;
+      elem_type mask = range_mask (i, limit);
+
+      if (value)
+        b->bits[idx] |= mask;
+      else
+        b->bits[idx] &= ~mask;
+      update_full (b, idx);
+    }
+  if (!value && cnt > 0 && start < b->first_free)
+    b->first_free = start;
+  else if (value && start <= b->first_free && end > b->first_free)
+    b->first_free = end;
+  /* End of Project 4 */
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -233,17 +390,25 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i, value_cnt;
+  /* Start of Project 4 */
+  size_t end = start + cnt;
+  size_t i, true_cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
-  return value_cnt;
+  /* Count a word at a time. */
+  true_cnt = 0;
+  for (i = start; i < end; i = ROUND_UP (i + 1, ELEM_BITS))
+    {
+      size_t idx = elem_idx (i);
+      size_t limit = (idx + 1) * ELEM_BITS < end ? (idx + 1) * ELEM_BITS : end;
+
+      true_cnt += count_bits (b->bits[idx] & range_mask (i, limit));
+    }
+  return value ? true_cnt : cnt - true_cnt;
+  /* End of Project 4 */
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -251,16 +416,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_next (b, start, value) < start + cnt;		/* Project 4 */
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -296,18 +456,36 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  /* Start of Project 4 */
+  size_t i = start;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt > b->bit_cnt)
+    return BITMAP_ERROR;
+  if (cnt == 0)
+    return start;
+
+  /* Nothing below first_free is false. */
+  if (!value && i < b->first_free)
+    i = b->first_free;
+
+  /* Jump from each run of VALUE bits to the next until one is long
+     enough. */
+  for (;;)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t run_start = find_next (b, i, value);
+      size_t run_end;
+
+      if (run_start + cnt > b->bit_cnt)
+        return BITMAP_ERROR;
+      run_end = find_next (b, run_start, !value);
+      if (run_end - run_start >= cnt)
+        return run_start;
+      i = run_end;
     }
-  return BITMAP_ERROR;
+  /* End of Project 4 */
 }
 
 /* Finds the first group of CNT consecutive bits in B at or after
@@ -345,8 +523,16 @@ bitmap_read (struct bitmap *b, struct file *file)
   if (b->bit_cnt > 0) 
     {
       off_t size = byte_cnt (b->bit_cnt);
+      size_t i;
+
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+
+      /* Start of Project 4 */
+      for (i = 0; i < elem_cnt (b->bit_cnt); i++)
+        update_full (b, i);
+      b->first_free = 0;
+      /* End of Project 4 */
     }
   return success;
 }
@@ -359,6 +545,25 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Start of Project 4 */
+/* Writes the bytes of B that hold the CNT bits starting at START
+   to the same place in FILE, leaving the rest of FILE alone.
+   Return true if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   size_t start, size_t cnt)
+{
+  off_t ofs, size;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (cnt <= b->bit_cnt - start);
+
+  ofs = start / CHAR_BIT;
+  size = DIV_ROUND_UP (start + cnt, CHAR_BIT) - ofs;
+  return file_write_at (file, (uint8_t *) b->bits + ofs, size, ofs) == size;
+}
+/* End of Project 4 */
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -375,16 +580,7 @@ bitmap_dump (const struct bitmap *b)
 uint32_t
 bimap_free_count (const struct bitmap *b)
 {
-  uint32_t i;
-  uint32_t free_count = 0;
-
-  for (i = 0; i < bitmap_size (b); i++)
-  {
-    if (!bitmap_test (b, i))
-      free_count++;
-  }
-
-  return free_count;
+  return bitmap_count (b, 0, bitmap_size (b), false);
 }
 
 /* End of Project 4 */
@@ -28,7 +28,13 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+    SYS_CACHESTAT,              /* Reads buffer cache statistics. */
+    SYS_GETDENTS,               /* Reads many directory entries. */
+    SYS_PREAD,                  /* Reads from a file at a position. */
+    SYS_PWRITE,                 /* Writes to a file at a position. */
+    SYS_READV,                  /* Reads into several buffers. */
+    SYS_WRITEV                  /* Writes from several buffers. */
   };
 
 #endif /* lib/syscall-nr.h */
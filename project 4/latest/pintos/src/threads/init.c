@@ -252,6 +252,21 @@ parse_options (char **argv)
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
 #endif
+      else if (!strcmp (name, "-ra"))
+        read_ahead_window = atoi (value);		/* Project 4 */
+      else if (!strcmp (name, "-cache"))
+        cache_size_limit = atoi (value);		/* Project 4 */
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          /* Start of Project 4 */
+          if (!strcmp (value, "clock"))
+            cache_policy = CACHE_CLOCK;
+          else if (!strcmp (value, "2q"))
+            cache_policy = CACHE_2Q;
+          else
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+          /* End of Project 4 */
+        }
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
@@ -286,7 +301,6 @@ run_task (char **argv)
   
   printf ("Executing '%s':\n", task);
 #ifdef USERPROG
-  thread_create ("write_behind_thread", PRI_MIN, write_behind_thread, NULL);
   process_wait (process_execute (task));
 #else
   run_test (task);
@@ -378,6 +392,9 @@ usage (void)
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
+          "  -ra=SECTORS        Read ahead SECTORS sectors (0 disables).\n"
+          "  -cache=SECTORS     Let the buffer cache grow to SECTORS sectors.\n"
+          "  -cache-policy=POL  Replace cache blocks by POL: clock or 2q (default).\n"
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
@@ -1,6 +1,7 @@
 #include "threads/thread.h"
 #include <debug.h>
 #include <stddef.h>
+#include <bitmap.h>
 #include <random.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,11 +36,6 @@ static struct list all_list;
 static struct list blocked_list;
 /* Start of Project 4 */
 
-/* Start of Project 2 */
-/* List of files currently opened or executed by all threads. */
-static struct list all_files;
-/* End of Project 2 */
-
 /* Idle thread. */
 static struct thread *idle_thread;
 
@@ -105,7 +101,6 @@ thread_init (void)
   list_init (&ready_list);
   list_init (&all_list);
   list_init (&blocked_list);			/* Project 4 */
-  list_init (&all_files);
 
   /* Set up a thread structure for the running thread. */
   initial_thread = running_thread ();
@@ -506,12 +501,14 @@ init_thread (struct thread *t, const char *name, int priority)
 
   /* Start of Project 2 */
 #ifdef USERPROG
-  list_init (&t->open_files);
+  t->fd_table = NULL;
+  t->fd_map = NULL;
   list_init (&t->child_processes);
   t->orphan = false;
   t->parent = running_thread ();
   lock_init (&t->lock_tid);
   t->fd_count = 0;
+  t->exec_file = NULL;
 #endif
   /* End of Project 2 */
   
@@ -647,24 +644,71 @@ uint32_t thread_stack_ofs = offsetof (struct thread, stack);
 /* Start of Project 2 */
 
 /* Returns the fd_name of the given file descriptor from
- * the current thread's open_files list */
+ * the current thread's fd_table, or NULL if FD is not open. */
 struct fd_name *
 get_fd_data (int fd)
 {
   struct thread *cur = thread_current ();
-  struct fd_name *fd_name;
-  struct list_elem *e;
-  
-  for (e = list_begin (&(cur->open_files));
-       e != list_end (&(cur->open_files));
-       e = list_next (e))
-  {
-     fd_name = list_entry (e, struct fd_name, elem);
 
-     if (fd_name->fd == fd)
-       return fd_name;
+  if (  fd < FD_FIRST || cur->fd_map == NULL
+     || (size_t) fd >= bitmap_size (cur->fd_map))
+    return NULL;
+  return cur->fd_table[fd];
+}
+
+/* Gives FD_NAME the lowest free file descriptor of the current
+ * thread, doubling its fd_table if every one is taken, and stores
+ * the descriptor in FD_NAME->fd.  Returns the descriptor, or -1 if
+ * memory is exhausted. */
+int
+fd_install (struct fd_name *fd_name)
+{
+  struct thread *cur = thread_current ();
+  size_t fd = BITMAP_ERROR;
+
+  if (cur->fd_map != NULL)
+    fd = bitmap_scan_and_flip (cur->fd_map, 0, 1, false);
+  if (fd == BITMAP_ERROR)
+  {
+    size_t old_cnt = cur->fd_map != NULL ? bitmap_size (cur->fd_map) : 0;
+    size_t new_cnt = old_cnt != 0 ? old_cnt * 2 : FD_TABLE_MIN;
+    struct fd_name **table;
+    struct bitmap *map;
+
+    table = realloc (cur->fd_table, new_cnt * sizeof *table);
+    if (table == NULL)
+      return -1;
+    cur->fd_table = table;
+    map = bitmap_create (new_cnt);
+    if (map == NULL)
+      return -1;
+
+    /* Every old descriptor was taken. */
+    memset (table + old_cnt, 0, (new_cnt - old_cnt) * sizeof *table);
+    bitmap_set_multiple (map, 0, old_cnt != 0 ? old_cnt : FD_FIRST, true);
+    bitmap_destroy (cur->fd_map);
+    cur->fd_map = map;
+    fd = bitmap_scan_and_flip (map, 0, 1, false);
   }
-  return NULL;
+
+  fd_name->fd = fd;
+  cur->fd_table[fd] = fd_name;
+  cur->fd_count++;
+  return fd;
+}
+
+/* Frees FD_NAME's file descriptor in the current thread, for the
+ * next fd_install() to reuse. */
+void
+fd_uninstall (struct fd_name *fd_name)
+{
+  struct thread *cur = thread_current ();
+
+  ASSERT (get_fd_data (fd_name->fd) == fd_name);
+
+  cur->fd_table[fd_name->fd] = NULL;
+  bitmap_reset (cur->fd_map, fd_name->fd);
+  cur->fd_count--;
 }
 
 /* Returns the child_process of the given pid.
@@ -688,97 +732,6 @@ get_wait_child (struct thread *t, tid_t pid)
   return NULL;
 }
 
-/* Returns the open_file of the given file name from
- * the all_files global list */
-struct open_file *
-get_file_open (const char *file_name)
-{
-  struct open_file *open_fp;
-  struct list_elem *e;
-
-  for (e = list_begin (&all_files);
-       e != list_end (&all_files);
-       e = list_next (e))
-  {
-     open_fp = list_entry (e, struct open_file, elem);
-
-     if (!strcmp (open_fp->file_name, file_name))
-       return open_fp;
-  }
-  return NULL;
-}
-
-/* Called from process_exit and CLOSE system call.
- * This function is used to check whether the given file should be removed
- * from the all_files global list or no. The boolean value is used to 
- * decide whether the call has come from process_exit or CLOSE system call
- * exec will be true for executing files. Also, we would decrement the 
- * count of exec_cnt or open_cnt depending upon the exec value. If
- * no thread is currently executing or if no thread has this file open, we
- * would remove it from the all_files list. */
-void
-check_remove_file (const char *file_name, bool exec)
-{
-  struct open_file *open_fp;
-
-  open_fp = get_file_open (file_name);
-
-  if (open_fp != NULL)
-  {
-    if (exec)
-      (open_fp->exec_cnt)--;
-    else
-      (open_fp->open_cnt)--;
-
-    if (  open_fp->open_cnt == 0
-       && open_fp->exec_cnt == 0)
-    {
-      list_remove (&open_fp->elem);
-      free (open_fp);
-    }
-  }
-}
-
-/* Called from process_execute and OPEN system call.
- * This function is used to check whether the given file should be added
- * to the all_files global list or no. The boolean value is used to 
- * decide whether the call has come from process_execute or OPEN system call
- * exec will be true for executing files. Also, we would increment the 
- * count of exec_cnt or open_cnt depending upon the exec value. If no thread
- * had perviously opened the file, we create a new open_file struct and
- * add it to the all_files list. */
-void
-add_new_file (const char *file_name, bool exec)
-{
-  struct open_file *open_fp;
-
-  open_fp = get_file_open (file_name);
-  if (open_fp != NULL)
-  {
-    if (exec)
-      open_fp->exec_cnt++;
-    else
-      open_fp->open_cnt++;
-  }
-  else
-  {
-    open_fp = (struct open_file *) malloc (sizeof (struct open_file));
-    strlcpy (open_fp->file_name, file_name, 16);
-    if (exec)
-    {
-      open_fp->exec_cnt = 1;
-      open_fp->open_cnt = 0;
-    }
-    else
-    {
-      open_fp->exec_cnt = 0;
-      open_fp->open_cnt = 1;
-    }
-    lock_init (&open_fp->lock);
-    list_push_back (&all_files, &(open_fp->elem));
-  }
-}
-
 /* End of Project 2 */
 
 /* Start of Project 4 */
@@ -30,21 +30,18 @@ typedef int tid_t;
 struct fd_name
   {
      int fd;				/* File descriptor of the open file */
-     char * file_name;			/* File name of the open file */
      struct file * file;		/* File pointer of the open file. */
      struct dir *dir;			/* Directory pointer if the fd represents directory. */
      bool is_dir;			/* Boolean to identify if the fd represents directory. */
-     struct list_elem elem;		/* Element in open_files list. */
   };
 
-struct open_file
-  {
-     char file_name[50];		/* File name of the open file */
-     int exec_cnt;			/* Number of times file is executing. */
-     int open_cnt;			/* Number of times file is opened. */
-     struct lock lock;			/* Lock for write synchronization. */
-     struct list_elem elem;		/* Element in all_files list. */
-  };
+/* Initial size of a process's file descriptor table.  It doubles
+   whenever every descriptor in it is taken. */
+#define FD_TABLE_MIN 16
+
+/* First descriptor handed out for a file; 0, 1 and 2 are the
+   console. */
+#define FD_FIRST 3
 
 struct child_process
   {
@@ -135,7 +132,8 @@ struct thread
     /* Owned by userprog/process.c. */
     uint32_t *pagedir;                  /* Page directory. */
     /* Start of Project 2 */
-    struct list open_files;		/* List of open files. */
+    struct fd_name **fd_table;		/* Open files, indexed by fd. */
+    struct bitmap *fd_map;		/* Descriptors taken in fd_table. */
     struct list child_processes;	/* List of all child processes of
     					 * current process. */
     bool orphan;			/* True if process is marked as orphan. */
@@ -143,6 +141,8 @@ struct thread
     struct lock lock_tid;		/* Lock for condition variable. */
     int fd_count;			/* Number of open file descriptors for
     					 * current thread. */
+    struct file *exec_file;		/* Executable being run, with writes
+    					 * to it denied. */
     /* End of Project 2 */
 #endif
 
@@ -192,10 +192,9 @@ int thread_get_load_avg (void);
 
 /* Start of Project 2 */
 struct fd_name * get_fd_data (int);
+int fd_install (struct fd_name *);
+void fd_uninstall (struct fd_name *);
 struct child_process * get_wait_child (struct thread *, tid_t);
-struct open_file * get_file_open (const char *);
-void check_remove_file (const char *, bool);
-void add_new_file (const char *, bool);
 /* End of Project 2 */
 
 #endif /* threads/thread.h */
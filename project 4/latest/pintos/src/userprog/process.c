@@ -1,4 +1,5 @@
 #include "userprog/process.h"
+#include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
 #include <round.h>
@@ -72,17 +73,11 @@ process_execute (const char *file_name)
     return TID_ERROR;
   }
 
-  /* After validating that this file can be loaded in the memory, we add this
-   * file to the list of all the open files and increment it's exec_cnt by 1
-   * as this file will be now being executed */
-  add_new_file (command, EXEC);
-
   /* End of Project 2 */
 
   tid = thread_create (command, PRI_DEFAULT, start_process, fn_copy);
   if (tid == TID_ERROR)
   {
-    //check_remove_file (command, EXEC);
     palloc_free_page (fn_copy);
   }
   //dir_close (dir); 
@@ -174,6 +169,7 @@ process_exit (void)
   struct list_elem *e;
   struct child_process *cur_process, *child;
   struct fd_name *open_fd;
+  size_t fd;
 
   /* Notify child process that parent process is dying.
    * This will help in handling orphan processes. */
@@ -205,12 +201,12 @@ process_exit (void)
 
 
   /* Close all open files of current process. */
-  e = list_begin (&(cur->open_files));
-  while (e != list_end (&(cur->open_files)))
+  for (fd = FD_FIRST; cur->fd_map != NULL && fd < bitmap_size (cur->fd_map);
+       fd++)
   {
-    open_fd = list_entry (e, struct fd_name, elem);
-    check_remove_file (open_fd->file_name, OPEN);
-
+    open_fd = cur->fd_table[fd];
+    if (open_fd == NULL)
+      continue;
     /* Start of Project 4 */
     if (open_fd->is_dir)
       dir_close (open_fd->dir);
@@ -218,12 +214,15 @@ process_exit (void)
       file_close (open_fd->file);
     /* End of Project 4 */
 
-    e = list_next (e);
-    list_remove (&open_fd->elem);
     free (open_fd);
   }
+  free (cur->fd_table);
+  bitmap_destroy (cur->fd_map);
+  cur->fd_table = NULL;
+  cur->fd_map = NULL;
 
-  check_remove_file (cur->name, EXEC);
+  /* Let the executable be written again. */
+  file_close (cur->exec_file);
 
   /* End of Project 2 */
 
@@ -456,7 +455,17 @@ load (char *file_name, void (**eip) (void), void **esp)
 
  done:
   /* We arrive here whether the load is successful or not. */
-  file_close (file);
+  /* Start of Project 2 */
+  /* Keep a running executable open, with writes to it denied,
+     until the process exits. */
+  if (success)
+  {
+    file_deny_write (file);
+    t->exec_file = file;
+  }
+  else
+    file_close (file);
+  /* End of Project 2 */
   return success;
 }
 
@@ -844,32 +853,24 @@ load_child_exec (char *file_name)
   struct file *file;
   struct Elf32_Ehdr ehdr;
   bool success = false;
-  struct open_file *open_fp;
-
-  open_fp = get_file_open (file_name);
 
-  if (open_fp != NULL && open_fp->exec_cnt > 0)
-    success = true;
+  /* Open executable file. */
+  file = filesys_open (file_name);
+  if (file == NULL)
+    success = false;
   else
   {
-    /* Open executable file. */
-    file = filesys_open (file_name);
-    if (file == NULL)
-      success = false;
-    else
-    {
-      /* Read and verify executable header. */
-       if( ehdr.e_ident[0] != ELFMAG0 || ehdr.e_ident[1] != ELFMAG1 ||
-           ehdr.e_ident[2] != ELFMAG2 || ehdr.e_ident[3] != ELFMAG3 )
-           success = true;
-       
-       if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) success = true;
-       if (ehdr.e_machine != EM_386) success = true;
-       if (ehdr.e_version != EV_CURRENT) success = true;
+    /* Read and verify executable header. */
+     if( ehdr.e_ident[0] != ELFMAG0 || ehdr.e_ident[1] != ELFMAG1 ||
+         ehdr.e_ident[2] != ELFMAG2 || ehdr.e_ident[3] != ELFMAG3 )
+         success = true;
+     
+     if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) success = true;
+     if (ehdr.e_machine != EM_386) success = true;
+     if (ehdr.e_version != EV_CURRENT) success = true;
 
  
-      file_close (file);
-    }
+    file_close (file);
   }
   return success;
 }
@@ -19,8 +19,6 @@ void process_exit (void);
 void process_activate (void);
 
 /* Start of Project 2 */
-#define EXEC true
-
 bool file_load (void *);
 bool is_file_exec (char *, void (**) (void), void **);
 void user_exit (int);
@@ -7,6 +7,7 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/directory.h"
+#include "filesys/cache.h"
 #include "devices/input.h"
 #include "devices/shutdown.h"
 #include "lib/user/syscall.h"
@@ -23,6 +24,11 @@ static void
 validate_addr(void **);
 /* End of Project 2 */
 
+/* Start of Project 4 */
+static void validate_buffer (const void *, size_t);
+static int transfer_iov (int, const struct iovec *, size_t, bool);
+/* End of Project 4 */
+
 void
 syscall_init (void) 
 {
@@ -49,7 +55,8 @@ syscall_handler (struct intr_frame *f UNUSED)
   off_t initial_size;
   void *buffer, *end_addr;
   uint32_t size, count;
-  struct open_file *open_fp UNUSED;
+  off_t ofs;						/* Project 4 */
+  const struct iovec *iov;				/* Project 4 */
   pid_t pid;
 
 
@@ -135,7 +142,6 @@ syscall_handler (struct intr_frame *f UNUSED)
                     * the file name is not NULL and whether the file exits in
                     * the root directory. */
 		   validate_addr((void **)(f->esp+4));
-		   struct open_file *open_fp;
 
     		   /* Check for valid file_name */
 		   if(!strcmp (file_name, ""))
@@ -159,18 +165,8 @@ syscall_handler (struct intr_frame *f UNUSED)
 		     break;
 		   }
 
-		   /* Insert file entry in current thread's open_files list. */
+		   /* Insert file entry in current thread's fd_table. */
 		   temp_fd = (struct fd_name *)malloc (sizeof(struct fd_name));
-		   if (list_empty (&(cur->open_files)))
-		   {
-		     temp_fd->fd = 3;
-		   }
-		   else
-		   {
-		     temp_fd->fd = (list_entry (list_rbegin (&(cur->open_files)),
-		     			     struct fd_name, elem))->fd + 1;
-		   }
-		   temp_fd->file_name = file_name;
 		   /* Start of Project 4 */
 		   if (inode_is_dir (fp->inode))
 		   {
@@ -185,13 +181,15 @@ syscall_handler (struct intr_frame *f UNUSED)
 		     temp_fd->is_dir = false;
 		   }
 		   /* End of Project 4 */
-		   list_push_back (&(cur->open_files), &(temp_fd->elem));
-		   (cur->fd_count)++;
-		   f->eax = temp_fd->fd;
-
-		   /* Insert file entry in all_files global list. If present,
-		    * increment open_cnt. */
-		   add_new_file (file_name, OPEN);
+		   f->eax = fd_install (temp_fd);
+		   if ((int) f->eax == -1)
+		   {
+		     if (temp_fd->is_dir)
+		       dir_close (temp_fd->dir);
+		     else
+		       file_close (temp_fd->file);
+		     free (temp_fd);
+		   }
 		   break;
 
     case SYS_FILESIZE:
@@ -278,24 +276,12 @@ syscall_handler (struct intr_frame *f UNUSED)
                    {
 		     fd_name = get_fd_data (fd);
 
-                     /* File descriptor is correct. Get fd entry and acquire
-		      * write lock from global list all_files to write to file. */
+                     /* File descriptor is correct.  The inode keeps
+		      * concurrent writers and readers apart, and writes
+		      * nothing while a process is running the file. */
 
                      if (fd_name != NULL)
-		     {
-		       open_fp = get_file_open (fd_name->file_name);
-		       
-		       /* Check for if the current file is not currently 
-		        * executing. */
-		       if (open_fp->exec_cnt == 0)
-		       {
-		         lock_acquire (&open_fp->lock);
-		         f->eax = file_write (fd_name->file, buffer, size);
-		         lock_release (&open_fp->lock);
-		       }
-		       else
-		         f->eax = 0;
-		     }
+		       f->eax = file_write (fd_name->file, buffer, size);
 		     else
 		       f->eax = 0;
                    }
@@ -351,8 +337,6 @@ syscall_handler (struct intr_frame *f UNUSED)
 		   /* Validate the input file descriptor. */
 		   if (fd_name != NULL)
 		   {
-		     check_remove_file (fd_name->file_name, OPEN);
-
 		     /* Start of Project 4 */
 		     if (fd_name->is_dir)
 		       dir_close (fd_name->dir);
@@ -360,7 +344,7 @@ syscall_handler (struct intr_frame *f UNUSED)
 		       file_close (fd_name->file);
 		     /* End of Project 4 */
 
-		     list_remove (&fd_name->elem);
+		     fd_uninstall (fd_name);
 		     free (fd_name);
 		   }
 		   break;
@@ -419,6 +403,93 @@ syscall_handler (struct intr_frame *f UNUSED)
 		     f->eax = inode_get_sector (fd_name->dir->inode);
 		   else
 		     f->eax = inode_get_sector (fd_name->file->inode);
+		   break;
+
+    /* Start of Project 4 */
+    case SYS_CACHESTAT:
+                   buffer = *(void **) (f->esp+4);
+                   end_addr = buffer + sizeof (struct cache_stats) - 1;
+
+                   /* Validate both ends of the user's buffer. */
+                   validate_addr ((void **) (f->esp+4));
+                   validate_addr (&end_addr);
+                   cache_get_stats (buffer);
+                   f->eax = 1;
+                   break;
+
+    case SYS_GETDENTS:
+                   /* Like SYS_READ's, the arguments are read from the
+                      user wrapper's frame, above its return address. */
+                   fd = *(int *) (f->esp+24);
+                   buffer = *(void **) (f->esp+28);
+                   count = *(uint32_t *) (f->esp+32);
+                   fd_name = get_fd_data (fd);
+
+                   /* Validate the input file descriptor. */
+                   if (fd_name == NULL || !fd_name->is_dir)
+                   {
+                     f->eax = -1;
+                     break;
+                   }
+                   if ((int) count <= 0)
+                   {
+                     f->eax = 0;
+                     break;
+                   }
+
+                   /* Validate both ends of the user's buffer. */
+                   validate_addr ((void **) (f->esp+28));
+                   if (count > (uint32_t) (PHYS_BASE - buffer)
+                               / sizeof (struct dirent))
+                     user_exit (-1);
+                   end_addr = buffer + count * sizeof (struct dirent) - 1;
+                   validate_addr (&end_addr);
+                   f->eax = dir_readdir_multiple (fd_name->dir, buffer, count,
+                                                  *(bool *) (f->esp+36));
+                   break;
+
+    case SYS_PREAD:
+    case SYS_PWRITE:
+                   /* Like SYS_READ's, the arguments are read from the
+                      user wrapper's frame, above its return address. */
+                   fd = *(int *) (f->esp+24);
+                   buffer = *(void **) (f->esp+28);
+                   size = *(uint32_t *) (f->esp+32);
+                   ofs = *(off_t *) (f->esp+36);
+                   fd_name = get_fd_data (fd);
+
+                   /* Only files have positions to read or write at. */
+                   if (fd_name == NULL || fd_name->is_dir || ofs < 0
+                       || (off_t) size < 0)
+                   {
+                     f->eax = -1;
+                     break;
+                   }
+                   validate_buffer (buffer, size);
+                   if (*syscall_num == SYS_PREAD)
+                     f->eax = file_read_at (fd_name->file, buffer, size, ofs);
+                   else
+                     f->eax = file_write_at (fd_name->file, buffer, size, ofs);
+                   break;
+
+    case SYS_READV:
+    case SYS_WRITEV:
+                   /* Like SYS_READ's, the arguments are read from the
+                      user wrapper's frame, above its return address. */
+                   fd = *(int *) (f->esp+20);
+                   iov = *(const struct iovec **) (f->esp+24);
+                   count = *(uint32_t *) (f->esp+28);
+
+                   if (count > IOV_MAX)
+                   {
+                     f->eax = -1;
+                     break;
+                   }
+                   validate_buffer (iov, count * sizeof *iov);
+                   f->eax = transfer_iov (fd, iov, count,
+                                          *syscall_num == SYS_WRITEV);
+                   break;
+    /* End of Project 4 */
   }
 
 }
@@ -438,3 +509,82 @@ validate_addr(void **vaddr)
            user_exit(-1);
 }
 
+/* Start of Project 4 */
+
+/* Validates both ends of the SIZE-byte user buffer at BUFFER, and
+ * that it does not wrap around.  Exits the process with a -1 return
+ * status if it is bad. */
+static void
+validate_buffer (const void *buffer, size_t size)
+{
+  void *start = (void *) buffer;
+  void *end = start + size - 1;
+
+  if (size == 0)
+    return;
+  validate_addr (&start);
+  if (size > (size_t) (PHYS_BASE - start))
+    user_exit (-1);
+  validate_addr (&end);
+}
+
+/* Reads into, or if WRITE writes from, the CNT user buffers that
+ * IOV describes, in order, as that many read or write system calls
+ * on FD would.  Every buffer is validated before any data moves.
+ * Stops after a short transfer.  Returns the number of bytes moved,
+ * or -1 if FD cannot be read or written. */
+static int
+transfer_iov (int fd, const struct iovec *iov, size_t cnt, bool write)
+{
+  struct fd_name *fd_name = NULL;
+  int total = 0;
+  size_t i, j;
+
+  if (fd == 0 || fd == 1)
+  {
+    if ((fd == 1) != write)
+      return -1;
+  }
+  else
+  {
+    fd_name = get_fd_data (fd);
+    if (fd_name == NULL || fd_name->is_dir)
+      return -1;
+  }
+
+  for (i = 0; i < cnt; i++)
+  {
+    if ((off_t) iov[i].iov_len < 0)
+      return -1;
+    validate_buffer (iov[i].iov_base, iov[i].iov_len);
+  }
+
+  for (i = 0; i < cnt; i++)
+  {
+    uint8_t *base = iov[i].iov_base;
+    off_t len = iov[i].iov_len, done;
+
+    if (fd == 1)
+    {
+      putbuf ((char *) base, len);
+      done = len;
+    }
+    else if (fd == 0)
+    {
+      for (j = 0; j < (size_t) len; j++)
+        base[j] = input_getc ();
+      done = len;
+    }
+    else if (write)
+      done = file_write (fd_name->file, base, len);
+    else
+      done = file_read (fd_name->file, base, len);
+
+    total += done;
+    if (done < len)
+      break;
+  }
+  return total;
+}
+
+/* End of Project 4 */
@@ -3,8 +3,4 @@
 
 void syscall_init (void);
 
-/* Start of Project 2 */
-#define OPEN false
-/* End of Project 2 */
-
 #endif /* userprog/syscall.h */